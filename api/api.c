@@ -23,29 +23,70 @@
 
 #include "pcidtf_def.h"
 #include <xpcf/status.h>
+#include <ctype.h>
 #ifdef WIN32
 #include <win/user/devenum.h>
 #include <initguid.h>
 #include <pcidtf_guid.h>
 #else
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #endif
 
+#define PCIDTF_SYSFS_CLASS	"/sys/class/pcidtf"
+
+/* Maximum number of threads probing devices in pcidtf_probe_all() */
+#define PCIDTF_PROBE_THREADS	8
+
 /* Local function prototypes */
+static PCIDTF_DEV *pcidtf_dev_new(void);
 static void pcidtf_dev_free(PCIDTF_DEV * dev);
+static int pcidtf_add_dev(PCIDTF * data, PCIDTF_DEV * dev);
+static int pcidtf_dev_describe(PCIDTF_DEV * dev);
+static int pcidtf_dev_probe(PCIDTF_DEV * dev);
+static int pcidtf_match_dev(const PCIDTF_FILTER * filter, PCIDTF_DEV * dev);
 static int pcidtf_enum(PCIDTF * data);
 
 XPCF_API_IMP(PCIDTF *) pcidtf_init(void)
+{
+	return pcidtf_init_filtered(NULL);
+}
+
+/* Make a filter that matches any device */
+XPCF_API_IMP(void)pcidtf_filter_init(PCIDTF_FILTER * filter)
+{
+	filter->vendor = -1;
+	filter->device = -1;
+	filter->subvendor = -1;
+	filter->subdevice = -1;
+	filter->class_code = 0;
+	filter->class_mask = 0;
+	filter->bdf = NULL;
+}
+
+/*
+ * Initialize the library with only the devices that match the filter.
+ * On Linux the filter is applied to the PCI attributes in sysfs, so
+ * devices that do not match are never opened.
+ */
+XPCF_API_IMP(PCIDTF *) pcidtf_init_filtered(const PCIDTF_FILTER * filter)
 {
 	PCIDTF *dtf;
 
 	dtf = (PCIDTF *) malloc(sizeof(PCIDTF));
 	if (dtf != NULL) {
 		memset(dtf, 0, sizeof(PCIDTF));
+		dtf->filter = filter;
 		if (pcidtf_enum(dtf)) {
-			free(dtf);
-			dtf = NULL;
+			pcidtf_cleanup(dtf);
+			return NULL;
 		}
+		dtf->filter = NULL;
 	}
 	return dtf;
 }
@@ -60,6 +101,7 @@ XPCF_API_IMP(void)pcidtf_cleanup(PCIDTF * dtf)
 			break;
 		pcidtf_dev_free(dev);
 	}
+	free(dtf->devs);
 	free(dtf);
 }
 
@@ -68,15 +110,79 @@ XPCF_API_IMP(int) pcidtf_get_dev_count(PCIDTF * dtf)
 	return dtf->count;
 }
 
+/*
+ * Devices are only listed by pcidtf_init(), and each one is opened on
+ * first use. NULL is returned if the device cannot be opened, e.g. because
+ * it was removed after being listed.
+ */
 XPCF_API_IMP(PCIDTF_DEV *) pcidtf_get_dev(PCIDTF * dtf, int idx)
 {
 	PCIDTF_DEV *dev = NULL;
 
 	if (idx >= 0 && idx < dtf->count)
 		dev = dtf->devs[idx];
+	if (dev != NULL && pcidtf_dev_probe(dev))
+		dev = NULL;
 	return dev;
 }
 
+#ifndef WIN32
+typedef struct pcidtf_probe_ctx {
+	PCIDTF *dtf;
+	int next;
+} PCIDTF_PROBE_CTX;
+
+/* Probe devices and load their BAR tables until none is left */
+static void *pcidtf_probe_thread(void *arg)
+{
+	PCIDTF_PROBE_CTX *ctx = (PCIDTF_PROBE_CTX *) arg;
+	PCIDTF_DEV *dev;
+	int idx, bar;
+
+	while ((idx = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED)) <
+	       ctx->dtf->count) {
+		dev = ctx->dtf->devs[idx];
+		if (pcidtf_dev_probe(dev))
+			continue;
+		for (bar = 0; bar < dev->iomap_count; bar++)
+			pcidtf_load_iomap(dev, bar);
+	}
+	return NULL;
+}
+#endif
+
+/*
+ * Open all listed devices and load their BAR tables, which are otherwise
+ * loaded on first use. Devices are probed by several threads in parallel.
+ * The number of devices that could be opened is returned.
+ */
+XPCF_API_IMP(int) pcidtf_probe_all(PCIDTF * dtf)
+{
+	int i, count = 0;
+#ifndef WIN32
+	PCIDTF_PROBE_CTX ctx;
+	pthread_t threads[PCIDTF_PROBE_THREADS];
+	int nthreads = 0;
+
+	ctx.dtf = dtf;
+	ctx.next = 0;
+	while (nthreads < PCIDTF_PROBE_THREADS && nthreads < dtf->count - 1 &&
+	       pthread_create(&threads[nthreads], NULL, pcidtf_probe_thread,
+			      &ctx) == 0)
+		nthreads++;
+	/* The calling thread takes part, and finishes alone if no thread runs */
+	pcidtf_probe_thread(&ctx);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+#endif
+
+	for (i = 0; i < dtf->count; i++) {
+		if (pcidtf_dev_probe(dtf->devs[i]) == 0)
+			count++;
+	}
+	return count;
+}
+
 XPCF_API_IMP(UINT8) pcidtf_dev_get_bus(PCIDTF_DEV * dev)
 {
 	return dev->bus;
@@ -87,6 +193,41 @@ XPCF_API_IMP(UINT8) pcidtf_dev_get_devfn(PCIDTF_DEV * dev)
 	return dev->devfn;
 }
 
+/*
+ * Get the descriptor read when the device was opened. The DMA buffer list
+ * is not included, and -1 is returned if the driver has no descriptor.
+ */
+XPCF_API_IMP(int)pcidtf_dev_get_desc(PCIDTF_DEV * dev, PCIDTF_DEV_DESC * desc)
+{
+	if (dev->desc.version == 0)
+		return -1;
+	*desc = dev->desc;
+	return 0;
+}
+
+/*
+ * Get the live DMA buffers of the device, including those allocated by
+ * other processes. Up to max buffers are stored in dmas, and the number of
+ * all buffers is returned.
+ */
+XPCF_API_IMP(int)pcidtf_dev_list_dma(PCIDTF_DEV * dev, PCIDTF_DMA_DESC * dmas,
+				     int max)
+{
+	PCIDTF_DEV_DESC desc;
+	int ret;
+
+	memset(&desc, 0, sizeof(desc));
+	desc.version = PCIDTF_DESC_VERSION;
+	desc.size = sizeof(desc);
+	desc.dma_max = max;
+	desc.dmas = dmas;
+	ret = xpcf_udev_ioctl(dev->udev, IOCTL_PCIDTF_GET_DESC, &desc,
+			      sizeof(desc), NULL);
+	if (ret)
+		return ret;
+	return desc.dma_count;
+}
+
 XPCF_API_IMP(int)pcidtf_dev_read_cfg(PCIDTF_DEV * dev, int off, int len,
 				     UINT32 * val)
 {
@@ -115,42 +256,345 @@ XPCF_API_IMP(int)pcidtf_dev_write_cfg(PCIDTF_DEV * dev, int off, int len,
 			       sizeof(data), NULL);
 }
 
+XPCF_API_IMP(int)pcidtf_dev_read_cfg_block(PCIDTF_DEV * dev, int off,
+					   void *buf, int len)
+{
+	PCIDTF_CFG_BLOCK data;
+
+	data.off = off;
+	data.len = len;
+	data.buf = buf;
+	return xpcf_udev_ioctl(dev->udev, IOCTL_PCIDTF_READ_CFG_BLOCK, &data,
+			       sizeof(data), NULL);
+}
+
+XPCF_API_IMP(int)pcidtf_dev_write_cfg_block(PCIDTF_DEV * dev, int off,
+					    void *buf, int len)
+{
+	PCIDTF_CFG_BLOCK data;
+
+	data.off = off;
+	data.len = len;
+	data.buf = buf;
+	return xpcf_udev_ioctl(dev->udev, IOCTL_PCIDTF_WRITE_CFG_BLOCK, &data,
+			       sizeof(data), NULL);
+}
+
+/*
+ * Execute register and configuration accesses in order, stopping at the
+ * first failure. The number of completed operations is returned in done
+ * unless it is NULL, so that the failed one is ops[*done] on error.
+ */
+XPCF_API_IMP(int)pcidtf_dev_exec_batch(PCIDTF_DEV * dev, PCIDTF_BATCH_OP * ops,
+					int count, int *done)
+{
+	PCIDTF_BATCH_DATA data;
+	int ret;
+
+	data.count = count;
+	data.done = 0;
+	data.ops = ops;
+	ret = xpcf_udev_ioctl(dev->udev, IOCTL_PCIDTF_BATCH, &data,
+			      sizeof(data), NULL);
+	if (done != NULL)
+		*done = data.done;
+	return ret;
+}
+
+/*
+ * Get the operation counters of a device. The driver sums its per-CPU
+ * counters, so this is cheap enough to be called periodically.
+ */
+XPCF_API_IMP(int)pcidtf_dev_get_stats(PCIDTF_DEV * dev,
+				      PCIDTF_DEV_STATS * stats)
+{
+	return xpcf_udev_ioctl(dev->udev, IOCTL_PCIDTF_GET_STATS, stats,
+			       sizeof(*stats), NULL);
+}
+
+XPCF_API_IMP(int)pcidtf_dev_run_bench(PCIDTF_DEV * dev, PCIDTF_BENCH * bench)
+{
+	return xpcf_udev_ioctl(dev->udev, IOCTL_PCIDTF_RUN_BENCH, bench,
+			       sizeof(*bench), NULL);
+}
+
+/*
+ * Upload a register microprogram. The ID of the validated program is
+ * returned, or a negative value on error.
+ */
+XPCF_API_IMP(int)pcidtf_dev_load_prog(PCIDTF_DEV * dev,
+				      PCIDTF_PROG_INSN * insns, int count,
+				      int result_count)
+{
+	PCIDTF_PROG data;
+	int ret;
+
+	memset(&data, 0, sizeof(data));
+	data.count = count;
+	data.result_count = result_count;
+	data.insns = insns;
+	if ((ret = xpcf_udev_ioctl(dev->udev, IOCTL_PCIDTF_LOAD_PROG, &data,
+				   sizeof(data), NULL)) < 0)
+		return ret;
+	return data.id;
+}
+
+XPCF_API_IMP(int)pcidtf_dev_run_prog(PCIDTF_DEV * dev, PCIDTF_PROG_RUN * run)
+{
+	return xpcf_udev_ioctl(dev->udev, IOCTL_PCIDTF_RUN_PROG, run,
+			       sizeof(*run), NULL);
+}
+
+XPCF_API_IMP(int)pcidtf_dev_free_prog(PCIDTF_DEV * dev, int id)
+{
+	return xpcf_udev_ioctl(dev->udev, IOCTL_PCIDTF_FREE_PROG, &id,
+			       sizeof(id), NULL);
+}
+
+/* Implement internal functions */
+
+void *pcidtf_dev_map(PCIDTF_DEV * dev, unsigned long pgoff, int len)
+{
+#ifdef WIN32
+	UNREFERENCED_PARAMETER(dev);
+	UNREFERENCED_PARAMETER(pgoff);
+	UNREFERENCED_PARAMETER(len);
+	return NULL;
+#else
+	long page_size = sysconf(_SC_PAGESIZE);
+	void *map;
+	int fd;
+
+	if ((fd = open(dev->path, O_RDWR)) < 0)
+		return NULL;
+	map = mmap(NULL, ((size_t)len + page_size - 1) & ~(page_size - 1),
+		   PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+		   (off_t) pgoff * page_size);
+	close(fd);
+	return map == MAP_FAILED ? NULL : map;
+#endif
+}
+
+void pcidtf_dev_unmap(void *map, int len)
+{
+#ifdef WIN32
+	UNREFERENCED_PARAMETER(map);
+	UNREFERENCED_PARAMETER(len);
+#else
+	long page_size = sysconf(_SC_PAGESIZE);
+
+	munmap(map, ((size_t)len + page_size - 1) & ~(page_size - 1));
+#endif
+}
+
 /* Implement local functions */
 
-static int pcidtf_enum_iomap(PCIDTF_DEV * dev)
+/* Read the description of a BAR on first use */
+PCIDTF_IOMAP *pcidtf_load_iomap(PCIDTF_DEV * dev, int bar)
 {
 	PCIDTF_REG_INFO req;
 	PCIDTF_IOMAP *iomap;
-	int bar;
 
-	for (bar = 0; bar < dev->iomap_count; bar++) {
-		req.bar = bar;
-		if (xpcf_udev_ioctl(dev->udev, IOCTL_PCIDTF_GET_REG,
-				    &req, sizeof(req), NULL) < 0)
-			break;
-		iomap = (PCIDTF_IOMAP *) malloc(sizeof(PCIDTF_IOMAP));
-		if (iomap == NULL)
+	iomap = (PCIDTF_IOMAP *) PCIDTF_LOAD_PTR(&dev->iomap[bar]);
+	if (iomap != NULL)
+		return iomap;
+
+	pcidtf_write_lock(&dev->lock);
+	if ((iomap = dev->iomap[bar]) != NULL)
+		goto done;
+	req.bar = bar;
+	if (xpcf_udev_ioctl(dev->udev, IOCTL_PCIDTF_GET_REG,
+			    &req, sizeof(req), NULL) < 0)
+		goto done;
+	iomap = (PCIDTF_IOMAP *) pcidtf_slab_alloc(&dev->iomap_slab);
+	if (iomap == NULL)
+		goto done;
+	iomap->dev = dev;
+	iomap->bar = bar;
+	iomap->len = req.len;
+	iomap->addr = req.addr;
+	iomap->map = NULL;
+	PCIDTF_STORE_PTR(&dev->iomap[bar], iomap);
+ done:
+	pcidtf_write_unlock(&dev->lock);
+	return iomap;
+}
+
+/*
+ * Slab chunks start with a link to the next chunk, padded so that the
+ * objects following it are suitably aligned.
+ */
+typedef union pcidtf_slab_chunk {
+	union pcidtf_slab_chunk *next;
+	UINT64 align;
+} PCIDTF_SLAB_CHUNK;
+
+void pcidtf_slab_init(PCIDTF_SLAB * slab, size_t size, int count)
+{
+	slab->chunks = NULL;
+	slab->free = NULL;
+	/* A free object holds the link of the free list */
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+	slab->size = (size + sizeof(UINT64) - 1) & ~(sizeof(UINT64) - 1);
+	slab->count = count;
+}
+
+/* Allocate an object, carving a new chunk if none is free */
+void *pcidtf_slab_alloc(PCIDTF_SLAB * slab)
+{
+	PCIDTF_SLAB_CHUNK *chunk;
+	char *obj;
+	void *ret;
+	int i;
+
+	if (slab->free == NULL) {
+		chunk = (PCIDTF_SLAB_CHUNK *) malloc(sizeof(PCIDTF_SLAB_CHUNK) +
+						     slab->size * slab->count);
+		if (chunk == NULL)
+			return NULL;
+		chunk->next = (PCIDTF_SLAB_CHUNK *) slab->chunks;
+		slab->chunks = chunk;
+		obj = (char *)(chunk + 1) + slab->size * slab->count;
+		for (i = 0; i < slab->count; i++) {
+			obj -= slab->size;
+			pcidtf_slab_free(slab, obj);
+		}
+	}
+	ret = slab->free;
+	slab->free = *(void **)ret;
+	return ret;
+}
+
+void pcidtf_slab_free(PCIDTF_SLAB * slab, void *obj)
+{
+	*(void **)obj = slab->free;
+	slab->free = obj;
+}
+
+/* Release all chunks, including objects that are still allocated */
+void pcidtf_slab_destroy(PCIDTF_SLAB * slab)
+{
+	PCIDTF_SLAB_CHUNK *chunk, *next;
+
+	for (chunk = (PCIDTF_SLAB_CHUNK *) slab->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	slab->chunks = NULL;
+	slab->free = NULL;
+}
+
+/* Append a device to the device table, growing it as needed */
+static int pcidtf_add_dev(PCIDTF * data, PCIDTF_DEV * dev)
+{
+	PCIDTF_DEV **devs;
+	int size;
+
+	if (data->count == data->size) {
+		size = data->size ? data->size * 2 : 16;
+		devs = (PCIDTF_DEV **) realloc(data->devs,
+					       sizeof(PCIDTF_DEV *) * size);
+		if (devs == NULL)
 			return XPCF_STS_MEM_ALLOC_ERR;
-		iomap->dev = dev;
-		iomap->bar = bar;
-		iomap->len = req.len;
-		iomap->addr = req.addr;
-		dev->iomap[bar] = iomap;
+		data->devs = devs;
+		data->size = size;
 	}
+	data->devs[data->count++] = dev;
 	return 0;
 }
 
+static PCIDTF_DEV *pcidtf_dev_new(void)
+{
+	PCIDTF_DEV *dev;
+
+	if ((dev = (PCIDTF_DEV *) malloc(sizeof(PCIDTF_DEV))) == NULL)
+		return NULL;
+	memset(dev, 0, sizeof(PCIDTF_DEV));
+	pcidtf_rwlock_init(&dev->lock);
+	pcidtf_slab_init(&dev->iomap_slab, sizeof(PCIDTF_IOMAP), MAX_BAR_COUNT);
+	pcidtf_slab_init(&dev->dma_slab, sizeof(PCIDTF_DMA), DMA_SLAB_COUNT);
+	dev->fd = -1;
+	return dev;
+}
+
 static void pcidtf_dev_free(PCIDTF_DEV * dev)
 {
 	int i;
 
-	for (i = 0; i < dev->iomap_count; i++)
-		free(dev->iomap[i]);
+	for (i = 0; i < dev->iomap_count; i++) {
+		if (dev->iomap[i] != NULL)
+			pcidtf_iomap_unmap(dev->iomap[i]);
+	}
+	/* Handles are released in bulk along with their slabs */
+	pcidtf_dev_free_dma_all(dev);
+	pcidtf_slab_destroy(&dev->iomap_slab);
+	pcidtf_slab_destroy(&dev->dma_slab);
 	if (dev->udev)
 		xpcf_udev_close(dev->udev);
+#ifndef WIN32
+	if (dev->fd >= 0)
+		close(dev->fd);
+#endif
+	pcidtf_rwlock_destroy(&dev->lock);
 	free(dev);
 }
 
+/* Match a string against a pattern with '*' and '?', ignoring case */
+static int pcidtf_match_pattern(const char *pat, const char *str)
+{
+	for (; *pat != '*'; pat++, str++) {
+		if (*pat == '\0')
+			return *str == '\0';
+		if (*str == '\0' ||
+		    (*pat != '?' && tolower((unsigned char)*pat) !=
+		     tolower((unsigned char)*str)))
+			return 0;
+	}
+	for (; *str != '\0'; str++) {
+		if (pcidtf_match_pattern(pat + 1, str))
+			return 1;
+	}
+	return pcidtf_match_pattern(pat + 1, str);
+}
+
+/*
+ * Match the IDs of a descriptor and a bus address in the form
+ * "dddd:bb:dd.f". A pattern without the domain matches any domain.
+ */
+static int pcidtf_match_desc(const PCIDTF_FILTER * filter,
+			     const PCIDTF_DEV_DESC * desc, const char *bdf)
+{
+	if ((filter->vendor >= 0 && filter->vendor != desc->vendor) ||
+	    (filter->device >= 0 && filter->device != desc->device) ||
+	    (filter->subvendor >= 0 && filter->subvendor != desc->subvendor) ||
+	    (filter->subdevice >= 0 && filter->subdevice != desc->subdevice) ||
+	    ((desc->class_code ^ filter->class_code) & filter->class_mask))
+		return 0;
+	if (filter->bdf == NULL)
+		return 1;
+	if (strchr(filter->bdf, ':') == strrchr(filter->bdf, ':')) {
+		bdf = strchr(bdf, ':');
+		if (bdf == NULL)
+			return 0;
+		bdf++;
+	}
+	return pcidtf_match_pattern(filter->bdf, bdf);
+}
+
+/*
+ * Match an opened device. Its domain is not known and taken as 0, and
+ * its IDs are all 0 if the driver has no descriptor.
+ */
+static int pcidtf_match_dev(const PCIDTF_FILTER * filter, PCIDTF_DEV * dev)
+{
+	char bdf[16];
+
+	snprintf(bdf, sizeof(bdf), "0000:%02x:%02x.%x", dev->bus,
+		 dev->devfn >> 3, dev->devfn & 7);
+	return pcidtf_match_desc(filter, &dev->desc, bdf);
+}
+
 #ifdef WIN32
 static void enum_handler(void *ctx,
 			 HDEVINFO hDevInfo,
@@ -159,78 +603,250 @@ static void enum_handler(void *ctx,
 {
 	PCIDTF *data = (PCIDTF *) ctx;
 	XPCF_UDEV *udev;
-	PCIDTF_DEV_INFO req;
 	PCIDTF_DEV *dev;
 
 	UNREFERENCED_PARAMETER(hDevInfo);
 	UNREFERENCED_PARAMETER(pDevInfoData);
 
 	if (xpcf_udev_open(pDevIntfDetailData->DevicePath, &udev) == 0) {
-		if (xpcf_udev_ioctl(udev, IOCTL_PCIDTF_GET_INFO,
-				    &req, sizeof(req), NULL)) {
-			xpcf_udev_close(udev);
-		} else if ((dev = (PCIDTF_DEV *) malloc(sizeof(PCIDTF_DEV))) ==
-			   NULL) {
+		if ((dev = pcidtf_dev_new()) == NULL) {
 			xpcf_udev_close(udev);
 		} else {
-			memset(dev, 0, sizeof(PCIDTF_DEV));
 			dev->udev = udev;
-			dev->bus = req.bus;
-			dev->devfn = req.devfn;
-			if (req.reg_count > MAX_BAR_COUNT) {
+			if (pcidtf_dev_describe(dev) ||
+			    (data->filter != NULL &&
+			     !pcidtf_match_dev(data->filter, dev))) {
 				pcidtf_dev_free(dev);
 			} else {
-				dev->iomap_count = req.reg_count;
-				if (pcidtf_enum_iomap(dev)) {
+				dev->probed = 1;
+				if (pcidtf_add_dev(data, dev))
 					pcidtf_dev_free(dev);
-				} else {
-					data->devs[data->count++] = dev;
-				}
 			}
 		}
 	}
 }
 #endif
 
+/*
+ * Open a device and read its description on first use. Windows devices
+ * are opened while they are enumerated.
+ */
+static int pcidtf_dev_probe(PCIDTF_DEV * dev)
+{
+	XPCF_UDEV *udev;
+	int probed = PCIDTF_LOAD_INT(&dev->probed);
+
+	if (probed)
+		return probed > 0 ? 0 : -1;
+
+	pcidtf_write_lock(&dev->lock);
+	if ((probed = dev->probed) == 0) {
+		probed = -1;
+		if (xpcf_udev_open(dev->path, &udev) == 0) {
+			dev->udev = udev;
+			/* The device may have been removed after being listed */
+			if (pcidtf_dev_describe(dev) == 0)
+				probed = 1;
+		}
+		PCIDTF_STORE_INT(&dev->probed, probed);
+	}
+	pcidtf_write_unlock(&dev->lock);
+	return probed > 0 ? 0 : -1;
+}
+
+/*
+ * Read the descriptor of an opened device, which also gives its BAR table.
+ * Drivers without the descriptor ioctl are asked for the basic information
+ * instead, and their BARs are described on first use.
+ */
+static int pcidtf_dev_describe(PCIDTF_DEV * dev)
+{
+	PCIDTF_DEV_DESC *desc = &dev->desc;
+	PCIDTF_DEV_INFO req;
+	PCIDTF_IOMAP *iomap;
+	int i;
+
+	memset(desc, 0, sizeof(PCIDTF_DEV_DESC));
+	desc->version = PCIDTF_DESC_VERSION;
+	desc->size = sizeof(PCIDTF_DEV_DESC);
+	if (xpcf_udev_ioctl(dev->udev, IOCTL_PCIDTF_GET_DESC,
+			    desc, sizeof(PCIDTF_DEV_DESC), NULL) == 0) {
+		if (desc->reg_count > MAX_BAR_COUNT)
+			return -1;
+		dev->bus = desc->bus;
+		dev->devfn = desc->devfn;
+		dev->iomap_count = desc->reg_count;
+		for (i = 0; i < dev->iomap_count; i++) {
+			iomap = (PCIDTF_IOMAP *)
+			    pcidtf_slab_alloc(&dev->iomap_slab);
+			if (iomap == NULL)
+				return XPCF_STS_MEM_ALLOC_ERR;
+			iomap->dev = dev;
+			iomap->bar = i;
+			iomap->len = (int)desc->bars[i].len;
+			iomap->addr = desc->bars[i].addr;
+			iomap->map = NULL;
+			dev->iomap[i] = iomap;
+		}
+		return 0;
+	}
+
+	desc->version = 0;
+	if (xpcf_udev_ioctl(dev->udev, IOCTL_PCIDTF_GET_INFO,
+			    &req, sizeof(req), NULL))
+		return -1;
+	if (req.reg_count > MAX_BAR_COUNT)
+		return -1;
+	dev->bus = req.bus;
+	dev->devfn = req.devfn;
+	dev->iomap_count = req.reg_count;
+	return 0;
+}
+
+#ifndef WIN32
+/* Add a device node to the device table without opening it */
+static int pcidtf_list_dev(PCIDTF * data, const char *name)
+{
+	PCIDTF_DEV *dev;
+	int ret;
+
+	if ((dev = pcidtf_dev_new()) == NULL)
+		return XPCF_STS_MEM_ALLOC_ERR;
+	snprintf(dev->path, sizeof(dev->path), "%s", name);
+	ret = pcidtf_add_dev(data, dev);
+	if (ret)
+		pcidtf_dev_free(dev);
+	return ret;
+}
+
+static int pcidtf_cmp_minor(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+static int pcidtf_read_sysfs(const char *dir, const char *attr,
+			     unsigned int *val)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+	int ret;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	if ((fp = fopen(path, "r")) == NULL)
+		return -1;
+	ret = fscanf(fp, "%x", val) == 1 ? 0 : -1;
+	fclose(fp);
+	return ret;
+}
+
+/* Match the PCI device of a class device by its sysfs attributes */
+static int pcidtf_match_sysfs(const PCIDTF_FILTER * filter, const char *name)
+{
+	PCIDTF_DEV_DESC desc;
+	char dir[PATH_MAX], link[PATH_MAX];
+	const char *bdf;
+	unsigned int val[5];
+	ssize_t len;
+
+	snprintf(dir, sizeof(dir), PCIDTF_SYSFS_CLASS "/%s/device", name);
+	len = readlink(dir, link, sizeof(link) - 1);
+	if (len < 0)
+		return 0;
+	link[len] = '\0';
+	bdf = strrchr(link, '/') ? strrchr(link, '/') + 1 : link;
+	if (pcidtf_read_sysfs(dir, "vendor", &val[0]) ||
+	    pcidtf_read_sysfs(dir, "device", &val[1]) ||
+	    pcidtf_read_sysfs(dir, "subsystem_vendor", &val[2]) ||
+	    pcidtf_read_sysfs(dir, "subsystem_device", &val[3]) ||
+	    pcidtf_read_sysfs(dir, "class", &val[4]))
+		return 0;
+	memset(&desc, 0, sizeof(desc));
+	desc.vendor = (UINT16) val[0];
+	desc.device = (UINT16) val[1];
+	desc.subvendor = (UINT16) val[2];
+	desc.subdevice = (UINT16) val[3];
+	desc.class_code = val[4];
+	return pcidtf_match_desc(filter, &desc, bdf);
+}
+
+/* Open the listed devices and keep those that match the filter */
+static void pcidtf_filter_devs(PCIDTF * data)
+{
+	PCIDTF_DEV *dev;
+	int i, count = 0;
+
+	pcidtf_probe_all(data);
+	for (i = 0; i < data->count; i++) {
+		dev = data->devs[i];
+		if (dev->probed > 0 && pcidtf_match_dev(data->filter, dev))
+			data->devs[count++] = dev;
+		else
+			pcidtf_dev_free(dev);
+	}
+	data->count = count;
+}
+#endif
+
+/*
+ * Minor numbers are allocated dynamically and may have gaps, so the
+ * devices are found by listing the pcidtf class in sysfs, or /dev if sysfs
+ * is not available, rather than by probing fixed names. The filter is
+ * applied to the sysfs attributes without opening any device.
+ */
 static int pcidtf_enum(PCIDTF * data)
 {
 #ifdef WIN32
 	return EnumDevNode(&GUID_PCIDTF_DEVICE_INTERFACE_CLASS, enum_handler,
 			   data);
 #else
-	XPCF_UDEV *udev;
-	PCIDTF_DEV *dev;
-	PCIDTF_DEV_INFO req;
-	char name[16];
-	int idx, ret = 0;
+	DIR *dir;
+	struct dirent *ent;
+	int *minors = NULL, *tmp;
+	int count = 0, size = 0, sysfs = 1;
+	int idx, minor, len, ret = 0;
+	char name[32];
 
 	data->count = 0;
-	for (idx = 0; idx < MAX_DEV_COUNT; idx++) {
-		snprintf(name, sizeof(name), "/dev/pcidtf%d", idx);
-		if (xpcf_udev_open(name, &udev))
+	if ((dir = opendir(PCIDTF_SYSFS_CLASS)) == NULL) {
+		sysfs = 0;
+		if ((dir = opendir("/dev")) == NULL)
+			return 0;
+	}
+	while ((ent = readdir(dir)) != NULL) {
+		if (sscanf(ent->d_name, "pcidtf%d%n", &minor, &len) != 1 ||
+		    ent->d_name[len] != '\0' || minor < 0)
 			continue;
-		ret = xpcf_udev_ioctl(udev, IOCTL_PCIDTF_GET_INFO,
-				      &req, sizeof(req), NULL);
-		if (ret) {
-			xpcf_udev_close(udev);
-			break;
-		}
-		if ((dev = (PCIDTF_DEV *) malloc(sizeof(PCIDTF_DEV))) == NULL) {
-			xpcf_udev_close(udev);
-			ret = XPCF_STS_MEM_ALLOC_ERR;
-			break;
+		if (sysfs && data->filter != NULL &&
+		    !pcidtf_match_sysfs(data->filter, ent->d_name))
+			continue;
+		if (count == size) {
+			size = size ? size * 2 : 16;
+			tmp = (int *)realloc(minors, sizeof(int) * size);
+			if (tmp == NULL) {
+				ret = XPCF_STS_MEM_ALLOC_ERR;
+				break;
+			}
+			minors = tmp;
 		}
-		memset(dev, 0, sizeof(PCIDTF_DEV));
-		dev->udev = udev;
-		dev->bus = req.bus;
-		dev->devfn = req.devfn;
-		ret = pcidtf_enum_iomap(dev);
-		if (ret) {
-			pcidtf_dev_free(dev);
-			break;
+		minors[count++] = minor;
+	}
+	closedir(dir);
+
+	if (ret == 0) {
+		qsort(minors, count, sizeof(int), pcidtf_cmp_minor);
+		for (idx = 0; idx < count; idx++) {
+			snprintf(name, sizeof(name), "/dev/pcidtf%d",
+				 minors[idx]);
+			ret = pcidtf_list_dev(data, name);
+			if (ret)
+				break;
 		}
-		data->devs[data->count++] = dev;
 	}
+	free(minors);
+
+	/* Without sysfs, the filter can only be applied to opened devices */
+	if (ret == 0 && !sysfs && data->filter != NULL)
+		pcidtf_filter_devs(data);
 	return ret;
 #endif
 }
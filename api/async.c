@@ -0,0 +1,301 @@
+/*
+ * PCI Device Test Framework
+ * User-mode Framework Library
+ * This file implements asynchronous requests through io_uring.
+ *
+ * Copyright (C) 2013-2014 Hiromitsu Sakamoto
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ */
+
+#include "pcidtf_def.h"
+#include <string.h>
+#ifndef WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+/*
+ * Requests are passed to the driver as io_uring passthrough commands, which
+ * need Linux 5.19 or later at both build and run time.
+ */
+#if !defined(WIN32) && defined(IORING_SETUP_SQE128)
+#define PCIDTF_HAVE_URING
+#endif
+
+#ifdef PCIDTF_HAVE_URING
+
+struct pcidtf_async {
+	int fd;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_len;
+	size_t cq_ring_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned sq_entries;
+	unsigned pending;
+};
+
+static int pcidtf_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int pcidtf_uring_enter(int fd, unsigned to_submit,
+			      unsigned min_complete, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			    flags, NULL, 0);
+}
+
+XPCF_API_IMP(PCIDTF_ASYNC *) pcidtf_async_init(int depth)
+{
+	PCIDTF_ASYNC *async;
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	async = (PCIDTF_ASYNC *) malloc(sizeof(PCIDTF_ASYNC));
+	if (async == NULL)
+		return NULL;
+	memset(async, 0, sizeof(PCIDTF_ASYNC));
+	memset(&p, 0, sizeof(p));
+
+	async->fd = pcidtf_uring_setup(depth, &p);
+	if (async->fd < 0) {
+		free(async);
+		return NULL;
+	}
+
+	async->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	async->cq_ring_len = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (async->cq_ring_len > async->sq_ring_len)
+			async->sq_ring_len = async->cq_ring_len;
+		async->cq_ring_len = async->sq_ring_len;
+	}
+	async->sq_ring = mmap(NULL, async->sq_ring_len,
+			      PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_POPULATE, async->fd,
+			      IORING_OFF_SQ_RING);
+	if (async->sq_ring == MAP_FAILED)
+		goto error;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		async->cq_ring = async->sq_ring;
+	} else {
+		async->cq_ring = mmap(NULL, async->cq_ring_len,
+				      PROT_READ | PROT_WRITE,
+				      MAP_SHARED | MAP_POPULATE, async->fd,
+				      IORING_OFF_CQ_RING);
+		if (async->cq_ring == MAP_FAILED)
+			goto error;
+	}
+	async->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	async->sqes = (struct io_uring_sqe *)mmap(NULL, async->sqes_len,
+						  PROT_READ | PROT_WRITE,
+						  MAP_SHARED | MAP_POPULATE,
+						  async->fd, IORING_OFF_SQES);
+	if (async->sqes == MAP_FAILED)
+		goto error;
+
+	sq = (char *)async->sq_ring;
+	async->sq_head = (unsigned *)(sq + p.sq_off.head);
+	async->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	async->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	async->sq_array = (unsigned *)(sq + p.sq_off.array);
+	cq = (char *)async->cq_ring;
+	async->cq_head = (unsigned *)(cq + p.cq_off.head);
+	async->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	async->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	async->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	async->sq_entries = p.sq_entries;
+	return async;
+
+ error:
+	pcidtf_async_cleanup(async);
+	return NULL;
+}
+
+XPCF_API_IMP(void)pcidtf_async_cleanup(PCIDTF_ASYNC * async)
+{
+	if (async->sqes != NULL && async->sqes != MAP_FAILED)
+		munmap(async->sqes, async->sqes_len);
+	if (async->cq_ring != NULL && async->cq_ring != MAP_FAILED &&
+	    async->cq_ring != async->sq_ring)
+		munmap(async->cq_ring, async->cq_ring_len);
+	if (async->sq_ring != NULL && async->sq_ring != MAP_FAILED)
+		munmap(async->sq_ring, async->sq_ring_len);
+	close(async->fd);
+	free(async);
+}
+
+/* Pass queued requests to the kernel, optionally waiting for completions */
+static int pcidtf_async_enter(PCIDTF_ASYNC * async, unsigned min_complete)
+{
+	int ret;
+
+	do {
+		ret = pcidtf_uring_enter(async->fd, async->pending,
+					 min_complete,
+					 min_complete ?
+					 IORING_ENTER_GETEVENTS : 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -errno;
+	async->pending -= ret;
+	return 0;
+}
+
+/*
+ * Queue a request without entering the kernel. The request is a driver
+ * ioctl code with its argument, which must stay valid until the request
+ * is reaped. Queued requests are submitted in a batch by
+ * pcidtf_async_reap(), or here if the submission queue is full.
+ */
+XPCF_API_IMP(int)pcidtf_async_submit(PCIDTF_ASYNC * async, PCIDTF_DEV * dev,
+				     unsigned int cmd, void *arg, UINT64 tag)
+{
+	struct io_uring_sqe *sqe;
+	PCIDTF_URING_CMD *data;
+	unsigned tail, idx;
+	int fd, ret;
+
+	if ((fd = PCIDTF_LOAD_INT(&dev->fd)) < 0) {
+		pcidtf_write_lock(&dev->lock);
+		if ((fd = dev->fd) < 0) {
+			fd = open(dev->path, O_RDWR);
+			ret = -errno;
+			PCIDTF_STORE_INT(&dev->fd, fd);
+		}
+		pcidtf_write_unlock(&dev->lock);
+		if (fd < 0)
+			return ret;
+	}
+	tail = *async->sq_tail;
+	if (tail - __atomic_load_n(async->sq_head, __ATOMIC_ACQUIRE) ==
+	    async->sq_entries) {
+		if ((ret = pcidtf_async_enter(async, 0)) < 0)
+			return ret;
+		if (tail - __atomic_load_n(async->sq_head, __ATOMIC_ACQUIRE) ==
+		    async->sq_entries)
+			return -EBUSY;
+	}
+
+	idx = tail & *async->sq_mask;
+	sqe = &async->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_URING_CMD;
+	sqe->fd = fd;
+	sqe->cmd_op = cmd;
+	sqe->user_data = tag;
+	data = (PCIDTF_URING_CMD *) sqe->cmd;
+	data->arg = (UINT64) (unsigned long)arg;
+	async->sq_array[idx] = idx;
+	__atomic_store_n(async->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	async->pending++;
+	return 0;
+}
+
+/*
+ * Submit queued requests and reap up to count completions, waiting until
+ * at least min_count are available. The number of reaped completions is
+ * returned.
+ */
+XPCF_API_IMP(int)pcidtf_async_reap(PCIDTF_ASYNC * async,
+				   PCIDTF_ASYNC_RESULT * res, int count,
+				   int min_count)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+	int n = 0, ret;
+
+	if (min_count > count)
+		min_count = count;
+	head = *async->cq_head;
+	tail = __atomic_load_n(async->cq_tail, __ATOMIC_ACQUIRE);
+	if (async->pending || (int)(tail - head) < min_count) {
+		/* The kernel waits until min_count completions are posted */
+		ret = pcidtf_async_enter(async,
+					 (int)(tail - head) < min_count ?
+					 (unsigned)min_count : 0);
+		if (ret < 0)
+			return ret;
+		tail = __atomic_load_n(async->cq_tail, __ATOMIC_ACQUIRE);
+	}
+	while (head != tail && n < count) {
+		cqe = &async->cqes[head & *async->cq_mask];
+		res[n].tag = cqe->user_data;
+		res[n].ret = cqe->res;
+		n++;
+		head++;
+	}
+	__atomic_store_n(async->cq_head, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+#else				/* PCIDTF_HAVE_URING */
+
+#ifndef UNREFERENCED_PARAMETER
+#define UNREFERENCED_PARAMETER(p) ((void)(p))
+#endif
+
+XPCF_API_IMP(PCIDTF_ASYNC *) pcidtf_async_init(int depth)
+{
+	UNREFERENCED_PARAMETER(depth);
+	return NULL;
+}
+
+XPCF_API_IMP(void)pcidtf_async_cleanup(PCIDTF_ASYNC * async)
+{
+	UNREFERENCED_PARAMETER(async);
+}
+
+XPCF_API_IMP(int)pcidtf_async_submit(PCIDTF_ASYNC * async, PCIDTF_DEV * dev,
+				     unsigned int cmd, void *arg, UINT64 tag)
+{
+	UNREFERENCED_PARAMETER(async);
+	UNREFERENCED_PARAMETER(dev);
+	UNREFERENCED_PARAMETER(cmd);
+	UNREFERENCED_PARAMETER(arg);
+	UNREFERENCED_PARAMETER(tag);
+	return -1;
+}
+
+XPCF_API_IMP(int)pcidtf_async_reap(PCIDTF_ASYNC * async,
+				   PCIDTF_ASYNC_RESULT * res, int count,
+				   int min_count)
+{
+	UNREFERENCED_PARAMETER(async);
+	UNREFERENCED_PARAMETER(res);
+	UNREFERENCED_PARAMETER(count);
+	UNREFERENCED_PARAMETER(min_count);
+	return -1;
+}
+
+#endif				/* PCIDTF_HAVE_URING */
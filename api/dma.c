@@ -22,10 +22,16 @@
  */
 
 #include "pcidtf_def.h"
+#include <string.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
 
-/* Local function prototype */
+/* Local function prototypes */
 static PCIDTF_DMA *pcidtf_dev_add_dma(PCIDTF_DEV * dev, int id, int len,
 				      unsigned long long addr);
+static PCIDTF_DMA *pcidtf_dev_find_dma(PCIDTF_DEV * dev, int id);
+static void pcidtf_dev_grow_dma_hash(PCIDTF_DEV * dev);
 
 XPCF_API_IMP(PCIDTF_DMA *) pcidtf_dev_alloc_dma(PCIDTF_DEV * dev, int len)
 {
@@ -40,15 +46,92 @@ XPCF_API_IMP(PCIDTF_DMA *) pcidtf_dev_alloc_dma(PCIDTF_DEV * dev, int len)
 	return dma;
 }
 
+/*
+ * Allocate a DMA buffer from cacheable memory. The buffer must be handed
+ * over by pcidtf_dma_sync() between CPU and device accesses.
+ */
+XPCF_API_IMP(PCIDTF_DMA *) pcidtf_dev_alloc_stream_dma(PCIDTF_DEV * dev,
+						       int len)
+{
+	PCIDTF_DMA *dma = NULL;
+	PCIDTF_DMA_INFO req;
+
+	req.len = len;
+	if (xpcf_udev_ioctl(dev->udev, IOCTL_PCIDTF_ALLOC_STREAM_DMA, &req,
+			    sizeof(req), NULL) == 0) {
+		dma = pcidtf_dev_add_dma(dev, req.id, len, req.addr);
+	}
+	return dma;
+}
+
+XPCF_API_IMP(int) pcidtf_dev_get_pool_stats(PCIDTF_DEV * dev,
+					    PCIDTF_POOL_STATS * stats)
+{
+	return xpcf_udev_ioctl(dev->udev, IOCTL_PCIDTF_GET_POOL_STATS, stats,
+			       sizeof(*stats), NULL);
+}
+
+XPCF_API_IMP(PCIDTF_DMA *) pcidtf_dev_map_user(PCIDTF_DEV * dev, void *buf,
+					       int len)
+{
+	PCIDTF_DMA *dma = NULL;
+	PCIDTF_SG_INFO req;
+	PCIDTF_SG_ENTRY *segs;
+	long page_size;
+
+#ifdef WIN32
+	page_size = 4096;
+#else
+	page_size = sysconf(_SC_PAGESIZE);
+#endif
+	/* A buffer never spans more segments than pages */
+	memset(&req, 0, sizeof(req));
+	req.len = len;
+	req.count = (int)(((size_t)len + page_size - 1) / page_size + 1);
+	req.buf = buf;
+	segs = (PCIDTF_SG_ENTRY *) malloc(sizeof(PCIDTF_SG_ENTRY) * req.count);
+	if (segs == NULL)
+		return NULL;
+	req.segs = segs;
+	if (xpcf_udev_ioctl(dev->udev, IOCTL_PCIDTF_MAP_USER, &req,
+			    sizeof(req), NULL) == 0) {
+		/* The handle takes its address from the first segment */
+		if (req.count > 0)
+			dma = pcidtf_dev_add_dma(dev, req.id, len,
+						 segs[0].addr);
+		else
+			xpcf_udev_ioctl(dev->udev, IOCTL_PCIDTF_FREE_DMA,
+					&req.id, sizeof(req.id), NULL);
+	}
+	if (dma == NULL) {
+		free(segs);
+		return NULL;
+	}
+	pcidtf_write_lock(&dev->lock);
+	if (dma->segs == NULL) {
+		dma->segs = segs;
+		dma->seg_count = req.count;
+		dma->cached = (req.flags & PCIDTF_SG_CACHED) != 0;
+		segs = NULL;
+	}
+	pcidtf_write_unlock(&dev->lock);
+	/* The segments are already set if another thread found the ID */
+	free(segs);
+	return dma;
+}
+
+/*
+ * Get a DMA buffer by ID, which may have been allocated by another process.
+ * Lookups only take the device lock for reading.
+ */
 XPCF_API_IMP(PCIDTF_DMA *) pcidtf_dev_get_dma(PCIDTF_DEV * dev, int id)
 {
 	PCIDTF_DMA *dma;
 	PCIDTF_DMA_INFO req;
 
-	for (dma = dev->dma; dma; dma = dma->next) {
-		if (dma->id == id)
-			break;
-	}
+	pcidtf_read_lock(&dev->lock);
+	dma = pcidtf_dev_find_dma(dev, id);
+	pcidtf_read_unlock(&dev->lock);
 	if (dma == NULL) {
 		req.id = id;
 		if (xpcf_udev_ioctl(dev->udev, IOCTL_PCIDTF_GET_DMA_INFO,
@@ -74,11 +157,53 @@ XPCF_API_IMP(UINT64) pcidtf_dma_get_addr(PCIDTF_DMA * dma)
 	return dma->addr;
 }
 
+XPCF_API_IMP(int)pcidtf_dma_get_seg_count(PCIDTF_DMA * dma)
+{
+	return dma->segs ? dma->seg_count : 1;
+}
+
+XPCF_API_IMP(int)pcidtf_dma_get_seg(PCIDTF_DMA * dma, int idx, UINT64 * addr,
+				    UINT64 * len)
+{
+	if (dma->segs == NULL) {
+		if (idx != 0)
+			return -1;
+		*addr = dma->addr;
+		*len = dma->len;
+	} else {
+		if (idx < 0 || idx >= dma->seg_count)
+			return -1;
+		*addr = dma->segs[idx].addr;
+		*len = dma->segs[idx].len;
+	}
+	return 0;
+}
+
+XPCF_API_IMP(int)pcidtf_dma_is_cached(PCIDTF_DMA * dma)
+{
+	return dma->cached;
+}
+
+/*
+ * Free a DMA buffer. The handle must not be used by other threads while or
+ * after it is freed.
+ */
 XPCF_API_IMP(void)pcidtf_dma_free(PCIDTF_DMA * dma)
 {
-	if (xpcf_udev_ioctl(dma->dev->udev, IOCTL_PCIDTF_FREE_DMA,
-			    &dma->id, sizeof(dma->id), NULL) == 0)
-		free(dma);
+	PCIDTF_DEV *dev = dma->dev;
+
+	pcidtf_dma_unmap(dma);
+	if (xpcf_udev_ioctl(dev->udev, IOCTL_PCIDTF_FREE_DMA,
+			    &dma->id, sizeof(dma->id), NULL) == 0) {
+		free(dma->segs);
+		pcidtf_write_lock(&dev->lock);
+		*dma->pprev = dma->next;
+		if (dma->next != NULL)
+			dma->next->pprev = dma->pprev;
+		dev->dma_count--;
+		pcidtf_slab_free(&dev->dma_slab, dma);
+		pcidtf_write_unlock(&dev->lock);
+	}
 }
 
 XPCF_API_IMP(int) pcidtf_dma_read(PCIDTF_DMA * dma, int off, void *buf, int len)
@@ -106,21 +231,159 @@ XPCF_API_IMP(int) pcidtf_dma_write(PCIDTF_DMA * dma, int off, void *buf,
 			       sizeof(req), NULL);
 }
 
-/* Implement local function */
+XPCF_API_IMP(int) pcidtf_dma_sync(PCIDTF_DMA * dma, int off, int len,
+				  int dir)
+{
+	PCIDTF_DMA_SYNC req;
+
+	req.id = dma->id;
+	req.off = off;
+	req.len = len;
+	req.dir = dir;
+	return xpcf_udev_ioctl(dma->dev->udev, IOCTL_PCIDTF_SYNC_DMA, &req,
+			       sizeof(req), NULL);
+}
+
+XPCF_API_IMP(void *) pcidtf_dma_map(PCIDTF_DMA * dma)
+{
+	void *map = PCIDTF_LOAD_PTR(&dma->map);
+
+	if (map == NULL) {
+		pcidtf_write_lock(&dma->dev->lock);
+		if ((map = dma->map) == NULL) {
+			map = pcidtf_dev_map(dma->dev,
+					     PCIDTF_MMAP_DMA_PGOFF(dma->id),
+					     dma->len);
+			PCIDTF_STORE_PTR(&dma->map, map);
+		}
+		pcidtf_write_unlock(&dma->dev->lock);
+	}
+	return map;
+}
 
+XPCF_API_IMP(void)pcidtf_dma_unmap(PCIDTF_DMA * dma)
+{
+	void *map;
+
+	pcidtf_write_lock(&dma->dev->lock);
+	map = dma->map;
+	dma->map = NULL;
+	pcidtf_write_unlock(&dma->dev->lock);
+	if (map != NULL)
+		pcidtf_dev_unmap(map, dma->len);
+}
+
+/* Implement local functions */
+
+/*
+ * Driver IDs are small integers allocated from 1 upwards, so their low bits
+ * spread handles evenly over the buckets.
+ */
+#define PCIDTF_DMA_BUCKET(dev, id) \
+	((dev)->dma_hash + ((unsigned)(id) & ((dev)->dma_hash_size - 1)))
+
+/* Find a DMA buffer by ID, with the device lock held */
+static PCIDTF_DMA *pcidtf_dev_find_dma(PCIDTF_DEV * dev, int id)
+{
+	PCIDTF_DMA *dma;
+
+	if (dev->dma_hash == NULL)
+		return NULL;
+	for (dma = *PCIDTF_DMA_BUCKET(dev, id); dma; dma = dma->next) {
+		if (dma->id == id)
+			break;
+	}
+	return dma;
+}
+
+/*
+ * Double the number of buckets, with the device lock held for writing. The
+ * table keeps working with longer chains if the allocation fails.
+ */
+static void pcidtf_dev_grow_dma_hash(PCIDTF_DEV * dev)
+{
+	PCIDTF_DMA **old = dev->dma_hash, **bucket, *dma, *next;
+	int old_size = dev->dma_hash_size, size, i;
+
+	size = old_size ? old_size * 2 : DMA_HASH_MIN;
+	bucket = (PCIDTF_DMA **) calloc(size, sizeof(PCIDTF_DMA *));
+	if (bucket == NULL)
+		return;
+	dev->dma_hash = bucket;
+	dev->dma_hash_size = size;
+	for (i = 0; i < old_size; i++) {
+		for (dma = old[i]; dma; dma = next) {
+			next = dma->next;
+			bucket = PCIDTF_DMA_BUCKET(dev, dma->id);
+			dma->next = *bucket;
+			dma->pprev = bucket;
+			if (*bucket != NULL)
+				(*bucket)->pprev = &dma->next;
+			*bucket = dma;
+		}
+	}
+	free(old);
+}
+
+/*
+ * Add a DMA buffer to the table. If another thread added the same ID in the
+ * meantime, its handle is returned instead.
+ */
 static PCIDTF_DMA *pcidtf_dev_add_dma(PCIDTF_DEV * dev, int id, int len,
 				      unsigned long long addr)
+{
+	PCIDTF_DMA *dma, **bucket;
+
+	pcidtf_write_lock(&dev->lock);
+	if ((dma = pcidtf_dev_find_dma(dev, id)) != NULL)
+		goto done;
+	if (dev->dma_count >= dev->dma_hash_size)
+		pcidtf_dev_grow_dma_hash(dev);
+	if (dev->dma_hash == NULL)
+		goto done;
+	dma = (PCIDTF_DMA *) pcidtf_slab_alloc(&dev->dma_slab);
+	if (dma == NULL)
+		goto done;
+	dma->dev = dev;
+	dma->id = id;
+	dma->len = len;
+	dma->addr = addr;
+	dma->map = NULL;
+	dma->segs = NULL;
+	dma->seg_count = 0;
+	dma->cached = 0;
+
+	bucket = PCIDTF_DMA_BUCKET(dev, id);
+	dma->next = *bucket;
+	dma->pprev = bucket;
+	if (*bucket != NULL)
+		(*bucket)->pprev = &dma->next;
+	*bucket = dma;
+	dev->dma_count++;
+ done:
+	pcidtf_write_unlock(&dev->lock);
+	return dma;
+}
+
+/*
+ * Release all DMA handles of a device that is being freed. The buffers
+ * themselves stay allocated in the driver; the handle objects go away with
+ * the slab.
+ */
+void pcidtf_dev_free_dma_all(PCIDTF_DEV * dev)
 {
 	PCIDTF_DMA *dma;
+	int i;
 
-	dma = (PCIDTF_DMA *) malloc(sizeof(PCIDTF_DMA));
-	if (dma != NULL) {
-		dma->dev = dev;
-		dma->id = id;
-		dma->len = len;
-		dma->addr = addr;
-		dma->next = dev->dma;
-		dev->dma = dma;
+	for (i = 0; i < dev->dma_hash_size; i++) {
+		for (dma = dev->dma_hash[i]; dma; dma = dma->next) {
+			if (dma->map != NULL)
+				pcidtf_dev_unmap(dma->map, dma->len);
+			free(dma->segs);
+		}
 	}
-	return dma;
+	free(dev->dma_hash);
+	dev->dma_hash = NULL;
+	dev->dma_hash_size = 0;
+	dev->dma_count = 0;
 }
@@ -22,6 +22,15 @@
  */
 
 #include "pcidtf_def.h"
+#include <string.h>
+
+/* Local function prototypes */
+static int pcidtf_iomap_load(PCIDTF_IOMAP * iomap, int off, int len,
+			     UINT64 * val);
+static int pcidtf_iomap_store(PCIDTF_IOMAP * iomap, int off, int len,
+			      UINT64 val);
+static int pcidtf_iomap_rw_block(PCIDTF_IOMAP * iomap, int read, int off,
+				 int width, void *buf, int len);
 
 XPCF_API_IMP(int) pcidtf_dev_get_iomap_count(PCIDTF_DEV * dev)
 {
@@ -32,7 +41,7 @@ XPCF_API_IMP(PCIDTF_IOMAP *) pcidtf_dev_get_iomap(PCIDTF_DEV * dev, int bar)
 {
 	if (bar < 0 || bar >= dev->iomap_count)
 		return NULL;
-	return dev->iomap[bar];
+	return pcidtf_load_iomap(dev, bar);
 }
 
 XPCF_API_IMP(int)pcidtf_iomap_get_bar(PCIDTF_IOMAP * iomap)
@@ -56,6 +65,8 @@ XPCF_API_IMP(int)pcidtf_iomap_read_reg(PCIDTF_IOMAP * iomap, int off, int len,
 	PCIDTF_REG_DATA data;
 	int ret;
 
+	if (pcidtf_iomap_load(iomap, off, len, val) == 0)
+		return 0;
 	data.bar = iomap->bar;
 	data.off = off;
 	data.len = len;
@@ -73,6 +84,8 @@ XPCF_API_IMP(int)pcidtf_iomap_write_reg(PCIDTF_IOMAP * iomap, int off,
 {
 	PCIDTF_REG_DATA data;
 
+	if (pcidtf_iomap_store(iomap, off, len, val) == 0)
+		return 0;
 	data.bar = iomap->bar;
 	data.off = off;
 	data.len = len;
@@ -80,3 +93,212 @@ XPCF_API_IMP(int)pcidtf_iomap_write_reg(PCIDTF_IOMAP * iomap, int off,
 	return xpcf_udev_ioctl(iomap->dev->udev, IOCTL_PCIDTF_WRITE_REG,
 			       &data, sizeof(data), NULL);
 }
+
+XPCF_API_IMP(int)pcidtf_iomap_poll_reg(PCIDTF_IOMAP * iomap, int off, int len,
+				       UINT64 mask, UINT64 expect, int timeout,
+				       int interval, UINT64 * val,
+				       UINT64 * elapsed)
+{
+	PCIDTF_POLL_DATA data;
+	int ret;
+
+	memset(&data, 0, sizeof(data));
+	data.bar = iomap->bar;
+	data.off = off;
+	data.len = len;
+	data.interval = interval;
+	data.timeout = timeout;
+	data.mask = mask;
+	data.expect = expect;
+	ret = xpcf_udev_ioctl(iomap->dev->udev, IOCTL_PCIDTF_POLL_REG,
+			      &data, sizeof(data), NULL);
+	if (val != NULL)
+		*val = data.val;
+	if (elapsed != NULL)
+		*elapsed = data.elapsed;
+	return ret;
+}
+
+/*
+ * Get the latency histogram of register accesses of the given width and
+ * direction made through the driver. Accesses through the mapping
+ * returned by pcidtf_iomap_map() are not measured.
+ */
+XPCF_API_IMP(int)pcidtf_iomap_get_reg_stats(PCIDTF_IOMAP * iomap, int width,
+					    int write, PCIDTF_REG_STATS * stats)
+{
+	memset(stats, 0, sizeof(PCIDTF_REG_STATS));
+	stats->bar = iomap->bar;
+	stats->width = width;
+	stats->write = write;
+	return xpcf_udev_ioctl(iomap->dev->udev, IOCTL_PCIDTF_GET_REG_STATS,
+			       stats, sizeof(PCIDTF_REG_STATS), NULL);
+}
+
+/* Reset the latency histograms of a BAR, or of all BARs if bar is -1 */
+XPCF_API_IMP(int)pcidtf_dev_reset_reg_stats(PCIDTF_DEV * dev, int bar)
+{
+	return xpcf_udev_ioctl(dev->udev, IOCTL_PCIDTF_RESET_REG_STATS,
+			       &bar, sizeof(bar), NULL);
+}
+
+/*
+ * Return the upper bound in nanoseconds of the histogram bucket holding
+ * the given percentile of the measured latencies.
+ */
+XPCF_API_IMP(UINT64) pcidtf_reg_stats_percentile(PCIDTF_REG_STATS * stats,
+						 int pct)
+{
+	UINT64 total = 0, target, bound;
+	int i;
+
+	for (i = 0; i < PCIDTF_LAT_BUCKETS; i++)
+		total += stats->buckets[i];
+	if (total == 0)
+		return 0;
+	target = (total * pct + 99) / 100;
+	for (i = 0, total = 0; i < PCIDTF_LAT_BUCKETS - 1; i++) {
+		total += stats->buckets[i];
+		if (total >= target)
+			break;
+	}
+	bound = (2ULL << i) - 1;
+	return bound < stats->max ? bound : stats->max;
+}
+
+XPCF_API_IMP(int) pcidtf_iomap_read_block(PCIDTF_IOMAP * iomap, int off,
+					   void *buf, int len)
+{
+	return pcidtf_iomap_rw_block(iomap, 1, off, 0, buf, len);
+}
+
+XPCF_API_IMP(int) pcidtf_iomap_write_block(PCIDTF_IOMAP * iomap, int off,
+					    void *buf, int len)
+{
+	return pcidtf_iomap_rw_block(iomap, 0, off, 0, buf, len);
+}
+
+XPCF_API_IMP(int) pcidtf_iomap_read_fifo(PCIDTF_IOMAP * iomap, int off,
+					  int width, void *buf, int len)
+{
+	return pcidtf_iomap_rw_block(iomap, 1, off, width, buf, len);
+}
+
+XPCF_API_IMP(int) pcidtf_iomap_write_fifo(PCIDTF_IOMAP * iomap, int off,
+					   int width, void *buf, int len)
+{
+	return pcidtf_iomap_rw_block(iomap, 0, off, width, buf, len);
+}
+
+XPCF_API_IMP(void *) pcidtf_iomap_map(PCIDTF_IOMAP * iomap)
+{
+	void *map = PCIDTF_LOAD_PTR(&iomap->map);
+
+	if (map == NULL) {
+		pcidtf_write_lock(&iomap->dev->lock);
+		if ((map = iomap->map) == NULL) {
+			map = pcidtf_dev_map(iomap->dev,
+					     PCIDTF_MMAP_BAR_PGOFF(iomap->bar),
+					     iomap->len);
+			PCIDTF_STORE_PTR(&iomap->map, map);
+		}
+		pcidtf_write_unlock(&iomap->dev->lock);
+	}
+	return map;
+}
+
+/*
+ * Unmap the BAR. Other threads must not access registers of the BAR while
+ * it is unmapped.
+ */
+XPCF_API_IMP(void)pcidtf_iomap_unmap(PCIDTF_IOMAP * iomap)
+{
+	void *map;
+
+	pcidtf_write_lock(&iomap->dev->lock);
+	map = iomap->map;
+	iomap->map = NULL;
+	pcidtf_write_unlock(&iomap->dev->lock);
+	if (map != NULL)
+		pcidtf_dev_unmap(map, iomap->len);
+}
+
+/* Implement local functions */
+
+static int pcidtf_iomap_rw_block(PCIDTF_IOMAP * iomap, int read, int off,
+				 int width, void *buf, int len)
+{
+	PCIDTF_BLOCK_DATA req;
+
+	req.bar = iomap->bar;
+	req.off = off;
+	req.len = len;
+	req.width = width;
+	req.buf = buf;
+	return xpcf_udev_ioctl(iomap->dev->udev,
+			       read ? IOCTL_PCIDTF_READ_BLOCK :
+			       IOCTL_PCIDTF_WRITE_BLOCK, &req, sizeof(req),
+			       NULL);
+}
+
+static int pcidtf_iomap_load(PCIDTF_IOMAP * iomap, int off, int len,
+			     UINT64 * val)
+{
+	volatile void *addr;
+	void *map = PCIDTF_LOAD_PTR(&iomap->map);
+
+	if (map == NULL || off < 0 || len <= 0 || off >= iomap->len ||
+	    len > iomap->len - off || (off & (len - 1)))
+		return -1;
+	addr = (volatile UINT8 *)map + off;
+	switch (len) {
+	case 1:
+		*val = *(volatile UINT8 *)addr;
+		break;
+	case 2:
+		*val = *(volatile UINT16 *)addr;
+		break;
+	case 4:
+		*val = *(volatile UINT32 *)addr;
+		break;
+#ifdef __LP64__
+	case 8:
+		*val = *(volatile UINT64 *)addr;
+		break;
+#endif
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+static int pcidtf_iomap_store(PCIDTF_IOMAP * iomap, int off, int len,
+			      UINT64 val)
+{
+	volatile void *addr;
+	void *map = PCIDTF_LOAD_PTR(&iomap->map);
+
+	if (map == NULL || off < 0 || len <= 0 || off >= iomap->len ||
+	    len > iomap->len - off || (off & (len - 1)))
+		return -1;
+	addr = (volatile UINT8 *)map + off;
+	switch (len) {
+	case 1:
+		*(volatile UINT8 *)addr = (UINT8) val;
+		break;
+	case 2:
+		*(volatile UINT16 *)addr = (UINT16) val;
+		break;
+	case 4:
+		*(volatile UINT32 *)addr = (UINT32) val;
+		break;
+#ifdef __LP64__
+	case 8:
+		*(volatile UINT64 *)addr = val;
+		break;
+#endif
+	default:
+		return -1;
+	}
+	return 0;
+}
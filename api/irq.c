@@ -0,0 +1,103 @@
+/*
+ * PCI Device Test Framework
+ * User-mode Framework Library
+ * This file implements interrupt functions.
+ *
+ * Copyright (C) 2013-2014 Hiromitsu Sakamoto
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ */
+
+#include "pcidtf_def.h"
+
+XPCF_API_IMP(int) pcidtf_dev_enable_irq(PCIDTF_DEV * dev, int type, int count)
+{
+	PCIDTF_IRQ_CONFIG req;
+	int ret;
+
+	req.type = type;
+	req.count = count;
+	ret = xpcf_udev_ioctl(dev->udev, IOCTL_PCIDTF_SET_IRQ, &req,
+			      sizeof(req), NULL);
+	if (ret)
+		return ret;
+	pcidtf_write_lock(&dev->lock);
+	dev->irq_type = req.type;
+	dev->irq_count = req.count;
+	pcidtf_write_unlock(&dev->lock);
+	return 0;
+}
+
+XPCF_API_IMP(int) pcidtf_dev_disable_irq(PCIDTF_DEV * dev)
+{
+	return pcidtf_dev_enable_irq(dev, PCIDTF_IRQ_NONE, 0);
+}
+
+XPCF_API_IMP(int) pcidtf_dev_get_irq_type(PCIDTF_DEV * dev)
+{
+	int type;
+
+	pcidtf_read_lock(&dev->lock);
+	type = dev->irq_type;
+	pcidtf_read_unlock(&dev->lock);
+	return type;
+}
+
+XPCF_API_IMP(int) pcidtf_dev_get_irq_count(PCIDTF_DEV * dev)
+{
+	int count;
+
+	pcidtf_read_lock(&dev->lock);
+	count = dev->irq_count;
+	pcidtf_read_unlock(&dev->lock);
+	return count;
+}
+
+XPCF_API_IMP(int) pcidtf_dev_set_irq_eventfd(PCIDTF_DEV * dev, int idx, int fd)
+{
+	PCIDTF_IRQ_EVENT req;
+
+	req.index = idx;
+	req.fd = fd;
+	return xpcf_udev_ioctl(dev->udev, IOCTL_PCIDTF_SET_IRQ_EVENT, &req,
+			       sizeof(req), NULL);
+}
+
+XPCF_API_IMP(int) pcidtf_dev_unmask_irq(PCIDTF_DEV * dev)
+{
+	int idx = 0;
+
+	return xpcf_udev_ioctl(dev->udev, IOCTL_PCIDTF_UNMASK_IRQ, &idx,
+			       sizeof(idx), NULL);
+}
+
+XPCF_API_IMP(int) pcidtf_irq_wait(PCIDTF_DEV * dev, int idx, int timeout,
+				  UINT64 * count, UINT64 * timestamp)
+{
+	PCIDTF_IRQ_WAIT req;
+	int ret;
+
+	req.index = idx;
+	req.timeout = timeout;
+	req.count = *count;
+	req.timestamp = 0;
+	ret = xpcf_udev_ioctl(dev->udev, IOCTL_PCIDTF_WAIT_IRQ, &req,
+			      sizeof(req), NULL);
+	*count = req.count;
+	if (timestamp != NULL)
+		*timestamp = req.timestamp;
+	return ret;
+}
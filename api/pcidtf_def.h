@@ -27,22 +27,93 @@
 #include "pcidtf_api.h"
 #include "pcidtf_ioctl.h"
 #include <xpcf/user/udev.h>
+#ifndef WIN32
+#include <pthread.h>
+#endif
 
-#define MAX_DEV_COUNT 10
 #define MAX_BAR_COUNT 6
+#define DMA_SLAB_COUNT 64	/* DMA handles carved per slab chunk */
+#define DMA_HASH_MIN 16		/* initial buckets of the DMA handle table */
+
+/*
+ * Reader-writer lock of a device, and atomic accessors of the fields that
+ * are read without the lock once they are set.
+ */
+#ifdef WIN32
+typedef SRWLOCK PCIDTF_RWLOCK;
+#define pcidtf_rwlock_init(l)		InitializeSRWLock(l)
+#define pcidtf_rwlock_destroy(l)	((void)(l))
+#define pcidtf_read_lock(l)		AcquireSRWLockShared(l)
+#define pcidtf_read_unlock(l)		ReleaseSRWLockShared(l)
+#define pcidtf_write_lock(l)		AcquireSRWLockExclusive(l)
+#define pcidtf_write_unlock(l)		ReleaseSRWLockExclusive(l)
+#define PCIDTF_LOAD_INT(p) \
+	InterlockedCompareExchange((volatile LONG *)(p), 0, 0)
+#define PCIDTF_STORE_INT(p, v) \
+	InterlockedExchange((volatile LONG *)(p), (v))
+#define PCIDTF_LOAD_PTR(p) \
+	InterlockedCompareExchangePointer((PVOID volatile *)(p), NULL, NULL)
+#define PCIDTF_STORE_PTR(p, v) \
+	InterlockedExchangePointer((PVOID volatile *)(p), (v))
+#else
+typedef pthread_rwlock_t PCIDTF_RWLOCK;
+#define pcidtf_rwlock_init(l)		pthread_rwlock_init(l, NULL)
+#define pcidtf_rwlock_destroy(l)	pthread_rwlock_destroy(l)
+#define pcidtf_read_lock(l)		pthread_rwlock_rdlock(l)
+#define pcidtf_read_unlock(l)		pthread_rwlock_unlock(l)
+#define pcidtf_write_lock(l)		pthread_rwlock_wrlock(l)
+#define pcidtf_write_unlock(l)		pthread_rwlock_unlock(l)
+#define PCIDTF_LOAD_INT(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define PCIDTF_STORE_INT(p, v)		__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define PCIDTF_LOAD_PTR(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define PCIDTF_STORE_PTR(p, v)		__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#endif
+
+/*
+ * Allocator of fixed-size objects. Objects are carved from chunks of count
+ * objects and recycled through a free list; chunks are only released all
+ * at once by pcidtf_slab_destroy().
+ */
+typedef struct pcidtf_slab {
+	void *chunks;
+	void *free;
+	size_t size;
+	int count;
+} PCIDTF_SLAB;
 
 struct pcidtf {
-	PCIDTF_DEV *devs[MAX_DEV_COUNT];
+	PCIDTF_DEV **devs;
 	int count;
+	int size;
+	const PCIDTF_FILTER *filter;	/* only valid during initialization */
 };
 
+/*
+ * A device may be used by several threads. The lock serializes opening the
+ * device and its lazily created objects, and protects the DMA handle table
+ * and the slabs. Ioctls are issued without the lock.
+ *
+ * DMA handles are hashed by ID into dma_hash, whose size is a power of two
+ * grown to keep at most one handle per bucket on average.
+ */
 struct pcidtf_dev {
+	PCIDTF_RWLOCK lock;
 	XPCF_UDEV *udev;
+	char path[32];
+	int fd;
+	int probed;		/* 1 if opened, -1 if failed, 0 if not yet */
 	UINT8 bus;
 	UINT8 devfn;
+	PCIDTF_DEV_DESC desc;	/* version 0 if the driver has none */
 	PCIDTF_IOMAP *iomap[MAX_BAR_COUNT];
 	int iomap_count;
-	PCIDTF_DMA *dma;
+	PCIDTF_DMA **dma_hash;
+	int dma_hash_size;
+	int dma_count;
+	PCIDTF_SLAB iomap_slab;
+	PCIDTF_SLAB dma_slab;
+	int irq_type;
+	int irq_count;
 };
 
 struct pcidtf_iomap {
@@ -50,14 +121,30 @@ struct pcidtf_iomap {
 	int bar;
 	int len;
 	unsigned long long addr;
+	void *map;
 };
 
 struct pcidtf_dma {
 	PCIDTF_DMA *next;
+	PCIDTF_DMA **pprev;
 	PCIDTF_DEV *dev;
 	int id;
 	int len;
 	unsigned long long addr;
+	void *map;
+	PCIDTF_SG_ENTRY *segs;
+	int seg_count;
+	int cached;
 };
 
+/* Internal functions */
+void *pcidtf_dev_map(PCIDTF_DEV * dev, unsigned long pgoff, int len);
+void pcidtf_dev_unmap(void *map, int len);
+PCIDTF_IOMAP *pcidtf_load_iomap(PCIDTF_DEV * dev, int bar);
+void pcidtf_dev_free_dma_all(PCIDTF_DEV * dev);
+void pcidtf_slab_init(PCIDTF_SLAB * slab, size_t size, int count);
+void *pcidtf_slab_alloc(PCIDTF_SLAB * slab);
+void pcidtf_slab_free(PCIDTF_SLAB * slab, void *obj);
+void pcidtf_slab_destroy(PCIDTF_SLAB * slab);
+
 #endif
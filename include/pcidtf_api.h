@@ -26,12 +26,35 @@
 #define _PCIDTF_API_H
 
 #include <xpcf/inttypes.h>
+#include "pcidtf_ioctl.h"
 
 /* Type definitions */
 typedef struct pcidtf PCIDTF;
 typedef struct pcidtf_dev PCIDTF_DEV;
 typedef struct pcidtf_iomap PCIDTF_IOMAP;
 typedef struct pcidtf_dma PCIDTF_DMA;
+typedef struct pcidtf_async PCIDTF_ASYNC;
+
+/*
+ * Device filter of pcidtf_init_filtered(). IDs of -1 match any value, and
+ * the class code is compared under class_mask. bdf is a pattern of the
+ * bus address such as "0000:03:*.0" or "03:00.?", or NULL for any.
+ */
+typedef struct pcidtf_filter {
+	int vendor;
+	int device;
+	int subvendor;
+	int subdevice;
+	UINT32 class_code;
+	UINT32 class_mask;
+	const char *bdf;
+} PCIDTF_FILTER;
+
+/* Completion of an asynchronous request */
+typedef struct pcidtf_async_result {
+	UINT64 tag;
+	int ret;
+} PCIDTF_ASYNC_RESULT;
 
 /*
  * Function prototypes
@@ -39,7 +62,10 @@ typedef struct pcidtf_dma PCIDTF_DMA;
 
 /* Global functions */
 XPCF_API(PCIDTF *) pcidtf_init(void);
+XPCF_API(void) pcidtf_filter_init(PCIDTF_FILTER * filter);
+XPCF_API(PCIDTF *) pcidtf_init_filtered(const PCIDTF_FILTER * filter);
 XPCF_API(void) pcidtf_cleanup(PCIDTF * dtf);
+XPCF_API(int) pcidtf_probe_all(PCIDTF * dtf);
 
 /* Device functions */
 XPCF_API(int) pcidtf_get_dev_count(PCIDTF * dtf);
@@ -47,10 +73,22 @@ XPCF_API(PCIDTF_DEV *) pcidtf_get_dev(PCIDTF * dtf, int idx);
 
 XPCF_API(UINT8) pcidtf_dev_get_bus(PCIDTF_DEV * dev);
 XPCF_API(UINT8) pcidtf_dev_get_devfn(PCIDTF_DEV * dev);
+XPCF_API(int) pcidtf_dev_get_desc(PCIDTF_DEV * dev, PCIDTF_DEV_DESC * desc);
+XPCF_API(int) pcidtf_dev_list_dma(PCIDTF_DEV * dev, PCIDTF_DMA_DESC * dmas,
+				  int max);
 XPCF_API(int) pcidtf_dev_read_cfg(PCIDTF_DEV * dev, int off, int len,
 				  UINT32 * val);
 XPCF_API(int) pcidtf_dev_write_cfg(PCIDTF_DEV * dev, int off, int len,
 				   UINT32 val);
+XPCF_API(int) pcidtf_dev_read_cfg_block(PCIDTF_DEV * dev, int off, void *buf,
+					int len);
+XPCF_API(int) pcidtf_dev_write_cfg_block(PCIDTF_DEV * dev, int off, void *buf,
+					 int len);
+XPCF_API(int) pcidtf_dev_exec_batch(PCIDTF_DEV * dev, PCIDTF_BATCH_OP * ops,
+				    int count, int *done);
+XPCF_API(int) pcidtf_dev_get_stats(PCIDTF_DEV * dev,
+				   PCIDTF_DEV_STATS * stats);
+XPCF_API(int) pcidtf_dev_run_bench(PCIDTF_DEV * dev, PCIDTF_BENCH * bench);
 
 /* I/O register map functions */
 XPCF_API(int) pcidtf_dev_get_iomap_count(PCIDTF_DEV * dev);
@@ -63,16 +101,74 @@ XPCF_API(int) pcidtf_iomap_read_reg(PCIDTF_IOMAP * iomap, int off, int len,
 				    UINT64 * val);
 XPCF_API(int) pcidtf_iomap_write_reg(PCIDTF_IOMAP * iomap, int off, int len,
 				     UINT64 val);
+XPCF_API(int) pcidtf_iomap_poll_reg(PCIDTF_IOMAP * iomap, int off, int len,
+				    UINT64 mask, UINT64 expect, int timeout,
+				    int interval, UINT64 * val,
+				    UINT64 * elapsed);
+XPCF_API(int) pcidtf_iomap_get_reg_stats(PCIDTF_IOMAP * iomap, int width,
+					 int write, PCIDTF_REG_STATS * stats);
+XPCF_API(int) pcidtf_dev_reset_reg_stats(PCIDTF_DEV * dev, int bar);
+XPCF_API(UINT64) pcidtf_reg_stats_percentile(PCIDTF_REG_STATS * stats,
+					      int pct);
+XPCF_API(int) pcidtf_iomap_read_block(PCIDTF_IOMAP * iomap, int off,
+				      void *buf, int len);
+XPCF_API(int) pcidtf_iomap_write_block(PCIDTF_IOMAP * iomap, int off,
+				       void *buf, int len);
+XPCF_API(int) pcidtf_iomap_read_fifo(PCIDTF_IOMAP * iomap, int off, int width,
+				     void *buf, int len);
+XPCF_API(int) pcidtf_iomap_write_fifo(PCIDTF_IOMAP * iomap, int off,
+				      int width, void *buf, int len);
+XPCF_API(void *) pcidtf_iomap_map(PCIDTF_IOMAP * iomap);
+XPCF_API(void) pcidtf_iomap_unmap(PCIDTF_IOMAP * iomap);
+
+/* Interrupt functions */
+XPCF_API(int) pcidtf_dev_enable_irq(PCIDTF_DEV * dev, int type, int count);
+XPCF_API(int) pcidtf_dev_disable_irq(PCIDTF_DEV * dev);
+XPCF_API(int) pcidtf_dev_get_irq_type(PCIDTF_DEV * dev);
+XPCF_API(int) pcidtf_dev_get_irq_count(PCIDTF_DEV * dev);
+XPCF_API(int) pcidtf_dev_set_irq_eventfd(PCIDTF_DEV * dev, int idx, int fd);
+XPCF_API(int) pcidtf_dev_unmask_irq(PCIDTF_DEV * dev);
+XPCF_API(int) pcidtf_irq_wait(PCIDTF_DEV * dev, int idx, int timeout,
+			      UINT64 * count, UINT64 * timestamp);
+
+/* Microprogram functions */
+XPCF_API(int) pcidtf_dev_load_prog(PCIDTF_DEV * dev,
+				   PCIDTF_PROG_INSN * insns, int count,
+				   int result_count);
+XPCF_API(int) pcidtf_dev_run_prog(PCIDTF_DEV * dev, PCIDTF_PROG_RUN * run);
+XPCF_API(int) pcidtf_dev_free_prog(PCIDTF_DEV * dev, int id);
 
 /* DMA buffer functions */
 XPCF_API(PCIDTF_DMA *) pcidtf_dev_alloc_dma(PCIDTF_DEV * dev, int len);
+XPCF_API(PCIDTF_DMA *) pcidtf_dev_alloc_stream_dma(PCIDTF_DEV * dev,
+						   int len);
+XPCF_API(int) pcidtf_dev_get_pool_stats(PCIDTF_DEV * dev,
+					PCIDTF_POOL_STATS * stats);
+XPCF_API(PCIDTF_DMA *) pcidtf_dev_map_user(PCIDTF_DEV * dev, void *buf,
+					   int len);
 XPCF_API(PCIDTF_DMA *) pcidtf_dev_get_dma(PCIDTF_DEV * dev, int id);
 XPCF_API(int) pcidtf_dma_get_id(PCIDTF_DMA * dma);
 XPCF_API(int) pcidtf_dma_get_len(PCIDTF_DMA * dma);
 
 XPCF_API(UINT64) pcidtf_dma_get_addr(PCIDTF_DMA * dma);
+XPCF_API(int) pcidtf_dma_get_seg_count(PCIDTF_DMA * dma);
+XPCF_API(int) pcidtf_dma_get_seg(PCIDTF_DMA * dma, int idx, UINT64 * addr,
+				 UINT64 * len);
+XPCF_API(int) pcidtf_dma_is_cached(PCIDTF_DMA * dma);
 XPCF_API(void) pcidtf_dma_free(PCIDTF_DMA * dma);
 XPCF_API(int) pcidtf_dma_read(PCIDTF_DMA * dma, int off, void *buf, int len);
 XPCF_API(int) pcidtf_dma_write(PCIDTF_DMA * dma, int off, void *buf, int len);
+XPCF_API(int) pcidtf_dma_sync(PCIDTF_DMA * dma, int off, int len, int dir);
+XPCF_API(void *) pcidtf_dma_map(PCIDTF_DMA * dma);
+XPCF_API(void) pcidtf_dma_unmap(PCIDTF_DMA * dma);
+
+/* Asynchronous request functions */
+XPCF_API(PCIDTF_ASYNC *) pcidtf_async_init(int depth);
+XPCF_API(void) pcidtf_async_cleanup(PCIDTF_ASYNC * async);
+XPCF_API(int) pcidtf_async_submit(PCIDTF_ASYNC * async, PCIDTF_DEV * dev,
+				  unsigned int cmd, void *arg, UINT64 tag);
+XPCF_API(int) pcidtf_async_reap(PCIDTF_ASYNC * async,
+				PCIDTF_ASYNC_RESULT * res, int count,
+				int min_count);
 
 #endif
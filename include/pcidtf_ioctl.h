@@ -32,12 +32,76 @@ typedef struct pcidtf_dev_info {
 	int reg_count;
 } PCIDTF_DEV_INFO;
 
+/* Version of PCIDTF_DEV_DESC, raised when fields are appended */
+#define PCIDTF_DESC_VERSION	1
+
+/* Flags of a BAR in PCIDTF_BAR_DESC */
+#define PCIDTF_BAR_IO		0x0001
+#define PCIDTF_BAR_MEM		0x0002
+#define PCIDTF_BAR_64BIT	0x0004
+#define PCIDTF_BAR_PREFETCH	0x0008
+
+typedef struct pcidtf_bar_desc {
+	int bar;		/* BAR index in configuration space */
+	int flags;
+	UINT64 addr;
+	UINT64 len;
+} PCIDTF_BAR_DESC;
+
+typedef struct pcidtf_dma_desc {
+	int id;
+	int type;		/* 0 coherent, 1 user, 2 streaming */
+	int len;
+	int reserved;
+	UINT64 addr;		/* bus address of the first segment */
+} PCIDTF_DMA_DESC;
+
+/* Interrupt types supported by a device, as bits of irq_caps */
+#define PCIDTF_IRQ_CAP(type)	(1 << (type))
+
+#define PCIDTF_MAX_DESC_DMAS	4096
+
+/*
+ * Device descriptor returned by a single ioctl. The caller sets version to
+ * PCIDTF_DESC_VERSION and size to the size of the structure it knows, and
+ * the driver returns the version it filled in. Live DMA buffers are
+ * written to dmas up to dma_max entries, while dma_count returns the
+ * number of all buffers.
+ */
+typedef struct pcidtf_dev_desc {
+	int version;
+	int size;
+	UINT16 vendor;
+	UINT16 device;
+	UINT16 subvendor;
+	UINT16 subdevice;
+	UINT32 class_code;	/* base class, subclass and interface */
+	UINT8 revision;
+	UINT8 bus;
+	UINT8 devfn;
+	UINT8 reserved;
+	int reg_count;
+	int irq_caps;
+	int msi_count;		/* vectors supported by the MSI capability */
+	int msix_count;		/* vectors supported by the MSI-X capability */
+	PCIDTF_BAR_DESC bars[6];
+	int dma_max;
+	int dma_count;
+	PCIDTF_DMA_DESC *dmas;
+} PCIDTF_DEV_DESC;
+
 typedef struct pcidtf_cfg_data {
 	int off;
 	int len;
 	UINT32 val;
 } PCIDTF_CFG_DATA;
 
+typedef struct pcidtf_cfg_block {
+	int off;
+	int len;
+	void *buf;
+} PCIDTF_CFG_BLOCK;
+
 typedef struct pcidtf_reg_info {
 	int bar;
 	int len;
@@ -64,6 +128,246 @@ typedef struct pcidtf_dma_data {
 	void *buf;
 } PCIDTF_DMA_DATA;
 
+/* Directions for PCIDTF_DMA_SYNC */
+#define PCIDTF_SYNC_FOR_DEVICE	0	/* after the CPU wrote the buffer */
+#define PCIDTF_SYNC_FOR_CPU	1	/* before the CPU reads the buffer */
+
+typedef struct pcidtf_dma_sync {
+	int id;
+	int off;
+	int len;
+	int dir;
+} PCIDTF_DMA_SYNC;
+
+typedef struct pcidtf_sg_entry {
+	UINT64 addr;
+	UINT64 len;
+} PCIDTF_SG_ENTRY;
+
+/* Flags for PCIDTF_SG_INFO */
+#define PCIDTF_SG_NOCACHE	0x0001	/* bypass the registration cache */
+#define PCIDTF_SG_CACHED	0x0002	/* returned: registration was cached */
+
+typedef struct pcidtf_sg_info {
+	int id;
+	int len;
+	int count;
+	int flags;
+	void *buf;
+	PCIDTF_SG_ENTRY *segs;
+} PCIDTF_SG_INFO;
+
+typedef struct pcidtf_poll_data {
+	int bar;
+	int off;
+	int len;
+	int interval;
+	int timeout;
+	int count;
+	UINT64 mask;
+	UINT64 expect;
+	UINT64 val;
+	UINT64 elapsed;
+} PCIDTF_POLL_DATA;
+
+typedef struct pcidtf_block_data {
+	int bar;
+	int off;
+	int len;
+	int width;
+	void *buf;
+} PCIDTF_BLOCK_DATA;
+
+/* Operation types of batched access */
+#define PCIDTF_BATCH_READ_CFG   1
+#define PCIDTF_BATCH_WRITE_CFG  2
+#define PCIDTF_BATCH_READ_REG   3
+#define PCIDTF_BATCH_WRITE_REG  4
+
+#define PCIDTF_MAX_BATCH_OPS    1024
+
+typedef struct pcidtf_batch_op {
+	int type;
+	int bar;
+	int off;
+	int len;
+	UINT64 val;
+} PCIDTF_BATCH_OP;
+
+typedef struct pcidtf_batch_data {
+	int count;
+	int done;
+	PCIDTF_BATCH_OP *ops;
+} PCIDTF_BATCH_DATA;
+
+/*
+ * Latency histogram of register accesses measured in the driver. Bucket n
+ * counts accesses that took from 2^n to 2^(n+1)-1 nanoseconds, and bucket
+ * 0 also counts those under a nanosecond. Writes are posted, so their
+ * latency is the time to issue them.
+ */
+#define PCIDTF_LAT_BUCKETS	32
+
+typedef struct pcidtf_reg_stats {
+	int bar;
+	int width;		/* access width in bytes */
+	int write;		/* 0 for reads, 1 for writes */
+	int reserved;
+	UINT64 count;
+	UINT64 min;		/* in nanoseconds */
+	UINT64 max;
+	UINT64 sum;
+	UINT64 buckets[PCIDTF_LAT_BUCKETS];
+} PCIDTF_REG_STATS;
+
+/* Benchmark types */
+#define PCIDTF_BENCH_DMA_READ	0	/* copy out of a coherent buffer */
+#define PCIDTF_BENCH_DMA_WRITE	1	/* copy into a coherent buffer */
+#define PCIDTF_BENCH_REG_READ	2	/* read sequentially from a BAR */
+#define PCIDTF_BENCH_REG_WRITE	3	/* write sequentially to a BAR */
+
+#define PCIDTF_MAX_BENCH_LEN	(64 << 20)
+#define PCIDTF_MAX_BENCH_ITERS	1000000
+
+/*
+ * Benchmark run in the driver. Each iteration copies len bytes between a
+ * kernel buffer and a temporary coherent buffer, or a range of a BAR. BAR
+ * ranges are copied with memcpy_toio/memcpy_fromio if width is 0, and by
+ * accesses of width bytes otherwise. The latency histogram is that of a
+ * whole iteration, and its bar, width and write fields echo the request.
+ */
+typedef struct pcidtf_bench {
+	int type;
+	int bar;
+	int off;
+	int width;
+	int len;
+	int iters;
+	UINT64 elapsed;		/* in nanoseconds */
+	UINT64 bytes_per_sec;
+	PCIDTF_REG_STATS lat;
+} PCIDTF_BENCH;
+
+/* Microprogram opcodes */
+#define PCIDTF_PROG_WRITE	1	/* write val */
+#define PCIDTF_PROG_READ	2	/* read into the accumulator */
+#define PCIDTF_PROG_RMW		3	/* replace the bits in mask by val */
+#define PCIDTF_PROG_POLL	4	/* read until (acc & mask) == val */
+#define PCIDTF_PROG_DELAY_NS	5	/* wait for arg nanoseconds */
+#define PCIDTF_PROG_BRANCH_IF	6	/* jump to target if (acc & mask) == val */
+#define PCIDTF_PROG_LOOP	7	/* jump to target until done count times */
+#define PCIDTF_PROG_STORE_RESULT 8	/* store the accumulator in result target */
+
+/* Pseudo BAR index that selects the configuration space */
+#define PCIDTF_PROG_CFG		(-1)
+
+#define PCIDTF_MAX_PROG_INSNS	4096
+#define PCIDTF_MAX_PROG_RESULTS	1024
+#define PCIDTF_MAX_PROG_TRACE	65536
+#define PCIDTF_MAX_PROG_STEPS	(1 << 24)
+#define PCIDTF_MAX_PROG_DELAY	1000000000	/* 1 s in nanoseconds */
+
+typedef struct pcidtf_prog_insn {
+	int op;
+	int bar;		/* BAR index or PCIDTF_PROG_CFG */
+	int off;
+	int len;		/* access width in bytes */
+	int target;		/* jump target or result index */
+	int count;		/* iterations of LOOP */
+	UINT64 val;
+	UINT64 mask;
+	UINT64 arg;		/* delay or poll timeout in nanoseconds */
+} PCIDTF_PROG_INSN;
+
+typedef struct pcidtf_prog {
+	int id;			/* returned by IOCTL_PCIDTF_LOAD_PROG */
+	int count;
+	int result_count;
+	int reserved;
+	PCIDTF_PROG_INSN *insns;
+} PCIDTF_PROG;
+
+typedef struct pcidtf_prog_trace {
+	int pc;
+	int reserved;
+	UINT64 timestamp;	/* nanoseconds since the program started */
+	UINT64 acc;
+} PCIDTF_PROG_TRACE;
+
+typedef struct pcidtf_prog_run {
+	int id;
+	int max_steps;		/* 0 for PCIDTF_MAX_PROG_STEPS */
+	int steps;		/* returned: number of executed steps */
+	int pc;			/* returned: where the program stopped */
+	int result_count;
+	int trace_count;	/* steps to record in trace */
+	UINT64 *results;
+	PCIDTF_PROG_TRACE *trace;
+} PCIDTF_PROG_RUN;
+
+/* Interrupt types */
+#define PCIDTF_IRQ_NONE   0
+#define PCIDTF_IRQ_AUTO   0
+#define PCIDTF_IRQ_MSIX   1
+#define PCIDTF_IRQ_MSI    2
+#define PCIDTF_IRQ_INTX   3
+
+#define PCIDTF_MAX_IRQS   64
+
+typedef struct pcidtf_irq_config {
+	int type;
+	int count;
+} PCIDTF_IRQ_CONFIG;
+
+typedef struct pcidtf_irq_event {
+	int index;
+	int fd;
+} PCIDTF_IRQ_EVENT;
+
+typedef struct pcidtf_irq_wait {
+	int index;
+	int timeout;
+	UINT64 count;
+	UINT64 timestamp;
+} PCIDTF_IRQ_WAIT;
+
+typedef struct pcidtf_pool_stats {
+	UINT64 hits;		/* allocations served from the pool */
+	UINT64 misses;		/* allocations passed to the DMA API */
+	UINT64 recycled;	/* freed buffers kept in the pool */
+	UINT64 released;	/* freed buffers returned to the DMA API */
+	UINT64 cached;		/* bytes held in the pool */
+} PCIDTF_POOL_STATS;
+
+/* Operation counters of a device, indexed by the number of the ioctl code */
+#define PCIDTF_STATS_OPS	64
+
+typedef struct pcidtf_op_stats {
+	UINT64 calls;
+	UINT64 bytes;		/* data moved by successful calls */
+	UINT64 errors;
+	UINT64 time;		/* cumulative time in nanoseconds */
+} PCIDTF_OP_STATS;
+
+typedef struct pcidtf_dev_stats {
+	PCIDTF_OP_STATS ops[PCIDTF_STATS_OPS];
+} PCIDTF_DEV_STATS;
+
+/*
+ * Command data of an io_uring passthrough (IORING_OP_URING_CMD) request.
+ * The command opcode is the ioctl code, and the argument is the same
+ * structure that the ioctl takes.
+ */
+typedef struct pcidtf_uring_cmd {
+	UINT64 arg;		/* user address of the ioctl argument */
+	UINT64 reserved;
+} PCIDTF_URING_CMD;
+
+/* Page offsets passed to mmap() to map a memory BAR or a DMA buffer */
+#define PCIDTF_MMAP_BAR_PGOFF(bar)  (bar)
+#define PCIDTF_MMAP_DMA_BASE        0x100
+#define PCIDTF_MMAP_DMA_PGOFF(id)   (PCIDTF_MMAP_DMA_BASE + (id))
+
 #define IOC_PCIDTF 'P'
 
 #define IOCTL_PCIDTF_GET_INFO       XPCF_IOR(IOC_PCIDTF, 0, PCIDTF_DEV_INFO)
@@ -77,5 +381,27 @@ typedef struct pcidtf_dma_data {
 #define IOCTL_PCIDTF_READ_DMA       XPCF_IOWR(IOC_PCIDTF, 8, PCIDTF_DMA_DATA)
 #define IOCTL_PCIDTF_WRITE_DMA      XPCF_IOW(IOC_PCIDTF, 9, PCIDTF_DMA_DATA)
 #define IOCTL_PCIDTF_GET_DMA_INFO   XPCF_IOWR(IOC_PCIDTF, 10, PCIDTF_DMA_INFO)
+#define IOCTL_PCIDTF_BATCH          XPCF_IOWR(IOC_PCIDTF, 11, PCIDTF_BATCH_DATA)
+#define IOCTL_PCIDTF_READ_BLOCK     XPCF_IOWR(IOC_PCIDTF, 12, PCIDTF_BLOCK_DATA)
+#define IOCTL_PCIDTF_WRITE_BLOCK    XPCF_IOW(IOC_PCIDTF, 13, PCIDTF_BLOCK_DATA)
+#define IOCTL_PCIDTF_READ_CFG_BLOCK XPCF_IOWR(IOC_PCIDTF, 14, PCIDTF_CFG_BLOCK)
+#define IOCTL_PCIDTF_WRITE_CFG_BLOCK XPCF_IOW(IOC_PCIDTF, 15, PCIDTF_CFG_BLOCK)
+#define IOCTL_PCIDTF_POLL_REG       XPCF_IOWR(IOC_PCIDTF, 16, PCIDTF_POLL_DATA)
+#define IOCTL_PCIDTF_SET_IRQ        XPCF_IOWR(IOC_PCIDTF, 17, PCIDTF_IRQ_CONFIG)
+#define IOCTL_PCIDTF_SET_IRQ_EVENT  XPCF_IOW(IOC_PCIDTF, 18, PCIDTF_IRQ_EVENT)
+#define IOCTL_PCIDTF_WAIT_IRQ       XPCF_IOWR(IOC_PCIDTF, 19, PCIDTF_IRQ_WAIT)
+#define IOCTL_PCIDTF_UNMASK_IRQ     XPCF_IOW(IOC_PCIDTF, 20, int)
+#define IOCTL_PCIDTF_MAP_USER       XPCF_IOWR(IOC_PCIDTF, 21, PCIDTF_SG_INFO)
+#define IOCTL_PCIDTF_GET_POOL_STATS XPCF_IOR(IOC_PCIDTF, 22, PCIDTF_POOL_STATS)
+#define IOCTL_PCIDTF_ALLOC_STREAM_DMA XPCF_IOWR(IOC_PCIDTF, 23, PCIDTF_DMA_INFO)
+#define IOCTL_PCIDTF_SYNC_DMA       XPCF_IOW(IOC_PCIDTF, 24, PCIDTF_DMA_SYNC)
+#define IOCTL_PCIDTF_LOAD_PROG      XPCF_IOWR(IOC_PCIDTF, 25, PCIDTF_PROG)
+#define IOCTL_PCIDTF_RUN_PROG       XPCF_IOWR(IOC_PCIDTF, 26, PCIDTF_PROG_RUN)
+#define IOCTL_PCIDTF_FREE_PROG      XPCF_IOW(IOC_PCIDTF, 27, int)
+#define IOCTL_PCIDTF_GET_REG_STATS  XPCF_IOWR(IOC_PCIDTF, 28, PCIDTF_REG_STATS)
+#define IOCTL_PCIDTF_RESET_REG_STATS XPCF_IOW(IOC_PCIDTF, 29, int)
+#define IOCTL_PCIDTF_GET_STATS      XPCF_IOR(IOC_PCIDTF, 30, PCIDTF_DEV_STATS)
+#define IOCTL_PCIDTF_RUN_BENCH      XPCF_IOWR(IOC_PCIDTF, 31, PCIDTF_BENCH)
+#define IOCTL_PCIDTF_GET_DESC       XPCF_IOWR(IOC_PCIDTF, 32, PCIDTF_DEV_DESC)
 
 #endif
@@ -0,0 +1,227 @@
+/*
+ * PCI Device Test Framework
+ * This file implements the in-kernel bandwidth benchmark.
+ *
+ * Copyright (C) 2013 Hiromitsu Sakamoto
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ */
+
+#include <linux/pci.h>
+#include <linux/fs.h>
+#include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/math64.h>
+#include <linux/dma-mapping.h>
+#include <asm/uaccess.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+#include <linux/io-64-nonatomic-lo-hi.h>
+#else
+#include <asm-generic/io-64-nonatomic-lo-hi.h>
+#endif
+
+#include "pcidtf.h"
+#include "pcidtf_ioctl.h"
+
+/* Access a BAR range sequentially with accesses of the given width */
+static void pcidtf_bench_io(void __iomem * addr, void *buf, int len,
+			    int width, int read)
+{
+	int pos;
+
+	switch (width) {
+	case 1:
+		for (pos = 0; pos < len; pos++) {
+			if (read)
+				((u8 *) buf)[pos] = ioread8(addr + pos);
+			else
+				iowrite8(((u8 *) buf)[pos], addr + pos);
+		}
+		break;
+	case 2:
+		for (pos = 0; pos < len; pos += 2) {
+			if (read)
+				*(u16 *) (buf + pos) = ioread16(addr + pos);
+			else
+				iowrite16(*(u16 *) (buf + pos), addr + pos);
+		}
+		break;
+	case 4:
+		for (pos = 0; pos < len; pos += 4) {
+			if (read)
+				*(u32 *) (buf + pos) = ioread32(addr + pos);
+			else
+				iowrite32(*(u32 *) (buf + pos), addr + pos);
+		}
+		break;
+	case 8:
+		for (pos = 0; pos < len; pos += 8) {
+			if (read)
+				*(u64 *) (buf + pos) = readq(addr + pos);
+			else
+				writeq(*(u64 *) (buf + pos), addr + pos);
+		}
+		break;
+	default:
+		if (read)
+			memcpy_fromio(buf, addr, len);
+		else
+			memcpy_toio(addr, buf, len);
+		break;
+	}
+}
+
+static void pcidtf_bench_record(PCIDTF_REG_STATS * lat, s64 ns)
+{
+	lat->buckets[pcidtf_lat_bucket(ns)]++;
+	lat->sum += ns;
+	if (lat->count == 0 || ns < lat->min)
+		lat->min = ns;
+	if (ns > lat->max)
+		lat->max = ns;
+	lat->count++;
+}
+
+/* Validate the BAR range of a register benchmark */
+static void __iomem *pcidtf_bench_bar(pcidtf_dev_t * dev, PCIDTF_BENCH * data)
+{
+	pcidtf_iomap_t *iomap;
+
+	if (data->bar < 0 || data->bar >= dev->iomap_count)
+		return NULL;
+	iomap = dev->iomap + data->bar;
+	if (data->off < 0 || data->off >= iomap->len ||
+	    data->len > iomap->len - data->off)
+		return NULL;
+	switch (data->width) {
+	case 0:
+	case 8:
+		if (!(iomap->flags & IORESOURCE_MEM))
+			return NULL;
+		break;
+	case 1:
+	case 2:
+	case 4:
+		break;
+	default:
+		return NULL;
+	}
+	if (data->width &&
+	    ((data->off | data->len) & (data->width - 1)) != 0)
+		return NULL;
+	return (unsigned char *)iomap->addr + data->off;
+}
+
+/*
+ * Run a benchmark for the requested number of iterations, yielding the
+ * processor between iterations. A pending signal stops the benchmark.
+ */
+long pcidtf_run_bench(pcidtf_dev_t * dev, unsigned long arg)
+{
+	PCIDTF_BENCH data;
+	void __iomem *addr = NULL;
+	void *buf = NULL, *vaddr = NULL;
+	dma_addr_t paddr;
+	s64 start, ns;
+	u64 total;
+	int i, read;
+	long ret = 0;
+
+	if (copy_from_user(&data, (int __user *)arg, sizeof(data))) {
+		ret = -EFAULT;
+		goto done;
+	}
+	if (data.len <= 0 || data.len > PCIDTF_MAX_BENCH_LEN ||
+	    data.iters <= 0 || data.iters > PCIDTF_MAX_BENCH_ITERS) {
+		ret = -EINVAL;
+		goto done;
+	}
+	switch (data.type) {
+	case PCIDTF_BENCH_DMA_READ:
+	case PCIDTF_BENCH_DMA_WRITE:
+		vaddr = dma_alloc_coherent(&dev->pdev->dev, data.len, &paddr,
+					   GFP_KERNEL);
+		if (vaddr == NULL) {
+			ret = -ENOMEM;
+			goto done;
+		}
+		break;
+	case PCIDTF_BENCH_REG_READ:
+	case PCIDTF_BENCH_REG_WRITE:
+		addr = pcidtf_bench_bar(dev, &data);
+		if (addr == NULL) {
+			ret = -EINVAL;
+			goto done;
+		}
+		break;
+	default:
+		ret = -EINVAL;
+		goto done;
+	}
+	read = (data.type == PCIDTF_BENCH_DMA_READ ||
+		data.type == PCIDTF_BENCH_REG_READ);
+
+	buf = vmalloc(data.len);
+	if (buf == NULL) {
+		ret = -ENOMEM;
+		goto done;
+	}
+	memset(buf, 0x5A, data.len);
+
+	memset(&data.lat, 0, sizeof(data.lat));
+	data.lat.bar = data.bar;
+	data.lat.width = data.width;
+	data.lat.write = !read;
+	data.elapsed = 0;
+	for (i = 0; i < data.iters; i++) {
+		if (signal_pending(current)) {
+			ret = -EINTR;
+			goto done;
+		}
+		start = ktime_to_ns(ktime_get());
+		if (addr)
+			pcidtf_bench_io(addr, buf, data.len, data.width, read);
+		else if (read)
+			memcpy(buf, vaddr, data.len);
+		else
+			memcpy(vaddr, buf, data.len);
+		ns = ktime_to_ns(ktime_get()) - start;
+		pcidtf_bench_record(&data.lat, ns);
+		data.elapsed += ns;
+		cond_resched();
+	}
+	total = (u64)data.len * data.iters;
+	pcidtf_count_bytes(dev, IOCTL_PCIDTF_RUN_BENCH, total);
+
+	/* Scale both terms down as needed to keep the product in range */
+	ns = data.elapsed;
+	while (total > div64_u64(U64_MAX, NSEC_PER_SEC)) {
+		total >>= 1;
+		ns >>= 1;
+	}
+	data.bytes_per_sec = ns ? div64_u64(total * NSEC_PER_SEC, ns) : 0;
+
+	if (copy_to_user((int __user *)arg, &data, sizeof(data)))
+		ret = -EFAULT;
+
+ done:
+	if (buf)
+		vfree(buf);
+	if (vaddr)
+		dma_free_coherent(&dev->pdev->dev, data.len, vaddr, paddr);
+	return ret;
+}
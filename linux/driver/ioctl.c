@@ -22,11 +22,41 @@
 
 #include <linux/pci.h>
 #include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/version.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/dma-mapping.h>
 #include <asm/uaccess.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+#include <linux/unaligned.h>
+#else
+#include <asm/unaligned.h>
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+#include <linux/io-64-nonatomic-lo-hi.h>
+#else
+#include <asm-generic/io-64-nonatomic-lo-hi.h>
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#include <linux/io_uring/cmd.h>
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+#include <linux/io_uring.h>
+#endif
 
 #include "pcidtf.h"
 #include "pcidtf_ioctl.h"
 
+#define CREATE_TRACE_POINTS
+#include "pcidtf_trace.h"
+
+/* Size of bounce buffer for block transfer */
+#define PCIDTF_BLOCK_CHUNK	(64 * 1024)
+
+/* Size of the first version of the device descriptor */
+#define PCIDTF_DESC_V1_SIZE	offsetofend(PCIDTF_DEV_DESC, dmas)
+
 long pcidtf_get_info(pcidtf_dev_t * dev, unsigned long arg)
 {
 	PCIDTF_DEV_INFO data;
@@ -34,11 +64,8 @@ long pcidtf_get_info(pcidtf_dev_t * dev, unsigned long arg)
 
 	data.bus = dev->pdev->bus->number;
 	data.devfn = dev->pdev->devfn;
+	data.reg_count = dev->iomap_count;
 
-	if (!access_ok(VERIFY_WRITE, (void __user *)arg, sizeof(data))) {
-		ret = -EFAULT;
-		goto done;
-	}
 	if (copy_to_user((int __user *)arg, &data, sizeof(data))) {
 		ret = -EFAULT;
 		goto done;
@@ -47,64 +74,284 @@ long pcidtf_get_info(pcidtf_dev_t * dev, unsigned long arg)
 	return ret;
 }
 
-long pcidtf_rw_cfg(pcidtf_dev_t * dev, unsigned int cmd, unsigned long arg)
+static void pcidtf_desc_irq(struct pci_dev *pdev, PCIDTF_DEV_DESC * data)
 {
-	PCIDTF_CFG_DATA data;
+	int count;
+
+	if (pdev->pin)
+		data->irq_caps |= PCIDTF_IRQ_CAP(PCIDTF_IRQ_INTX);
+	count = pci_msi_vec_count(pdev);
+	if (count > 0) {
+		data->irq_caps |= PCIDTF_IRQ_CAP(PCIDTF_IRQ_MSI);
+		data->msi_count = count;
+	}
+	count = pci_msix_vec_count(pdev);
+	if (count > 0) {
+		data->irq_caps |= PCIDTF_IRQ_CAP(PCIDTF_IRQ_MSIX);
+		data->msix_count = count;
+	}
+}
+
+/* Copy up to max descriptors of live DMA buffers, returning their number */
+static int pcidtf_desc_dma(pcidtf_dev_t * dev, PCIDTF_DMA_DESC * descs,
+			   int max)
+{
+	pcidtf_dma_t *dma;
+	int id, count = 0;
+
+	spin_lock(&dev->dma_lock);
+	idr_for_each_entry(&dev->dma_idr, dma, id) {
+		if (count < max) {
+			descs[count].id = id;
+			descs[count].type = dma->type;
+			descs[count].len = dma->len;
+			descs[count].reserved = 0;
+			descs[count].addr = dma->paddr;
+		}
+		count++;
+	}
+	spin_unlock(&dev->dma_lock);
+	return count;
+}
+
+/*
+ * Describe the device in a single call: its IDs, BAR table, interrupt
+ * capabilities and live DMA buffers. The descriptor only grows at its end,
+ * so any caller passing at least the first version is served: only the
+ * bytes both sides know are copied, and the version returned is the older
+ * of the caller's and the driver's. Fields added by a later version must
+ * only be filled in when the caller asked for that version.
+ */
+long pcidtf_get_desc(pcidtf_dev_t * dev, unsigned long arg)
+{
+	PCIDTF_DEV_DESC data;
+	PCIDTF_DMA_DESC *descs = NULL;
+	struct pci_dev *pdev = dev->pdev;
+	pcidtf_iomap_t *iomap;
+	PCIDTF_BAR_DESC *bar;
+	int i, count, size;
 	long ret = 0;
 
 	memset(&data, 0, sizeof(data));
-
-	if (copy_from_user(&data, (int __user *)arg, sizeof(data))) {
+	if (copy_from_user(&data, (int __user *)arg, PCIDTF_DESC_V1_SIZE)) {
 		ret = -EFAULT;
 		goto done;
 	}
-	printk("IOCTL - cmd=0x%X, off=%d, len=%d\n", cmd, data.off, data.len);
-
-	if (data.off < 0) {
+	if (data.version < 1 || data.size < (int)PCIDTF_DESC_V1_SIZE ||
+	    data.dma_max < 0 || data.dma_max > PCIDTF_MAX_DESC_DMAS) {
 		ret = -EINVAL;
 		goto done;
 	}
-	switch (data.len) {
+	size = min_t(int, data.size, sizeof(data));
+	if (size > (int)PCIDTF_DESC_V1_SIZE &&
+	    copy_from_user((unsigned char *)&data + PCIDTF_DESC_V1_SIZE,
+			   (unsigned char __user *)arg + PCIDTF_DESC_V1_SIZE,
+			   size - PCIDTF_DESC_V1_SIZE)) {
+		ret = -EFAULT;
+		goto done;
+	}
+	if (data.dma_max > 0) {
+		descs = kmalloc(sizeof(PCIDTF_DMA_DESC) * data.dma_max,
+				GFP_KERNEL);
+		if (descs == NULL) {
+			ret = -ENOMEM;
+			goto done;
+		}
+	}
+
+	data.version = min(data.version, PCIDTF_DESC_VERSION);
+	data.size = size;
+	data.vendor = pdev->vendor;
+	data.device = pdev->device;
+	data.subvendor = pdev->subsystem_vendor;
+	data.subdevice = pdev->subsystem_device;
+	data.class_code = pdev->class;
+	data.revision = pdev->revision;
+	data.bus = pdev->bus->number;
+	data.devfn = pdev->devfn;
+	data.reserved = 0;
+	data.reg_count = dev->iomap_count;
+
+	data.irq_caps = 0;
+	data.msi_count = 0;
+	data.msix_count = 0;
+	pcidtf_desc_irq(pdev, &data);
+
+	memset(data.bars, 0, sizeof(data.bars));
+	for (i = 0, iomap = dev->iomap, bar = data.bars;
+	     i < dev->iomap_count; i++, iomap++, bar++) {
+		bar->bar = iomap->bar;
+		bar->addr = iomap->start;
+		bar->len = iomap->len;
+		if (iomap->flags & IORESOURCE_IO)
+			bar->flags |= PCIDTF_BAR_IO;
+		if (iomap->flags & IORESOURCE_MEM)
+			bar->flags |= PCIDTF_BAR_MEM;
+		if (iomap->flags & IORESOURCE_MEM_64)
+			bar->flags |= PCIDTF_BAR_64BIT;
+		if (iomap->flags & IORESOURCE_PREFETCH)
+			bar->flags |= PCIDTF_BAR_PREFETCH;
+	}
+
+	data.dma_count = pcidtf_desc_dma(dev, descs, data.dma_max);
+	count = min(data.dma_count, data.dma_max);
+	if (count > 0) {
+		if (copy_to_user((void __user *)data.dmas, descs,
+				 sizeof(PCIDTF_DMA_DESC) * count)) {
+			ret = -EFAULT;
+			goto done;
+		}
+	}
+
+	if (copy_to_user((int __user *)arg, &data, size))
+		ret = -EFAULT;
+
+ done:
+	kfree(descs);
+	return ret;
+}
+
+int pcidtf_cfg_rw(pcidtf_dev_t * dev, int read, int off, int len, u32 * val)
+{
+	u8 val8;
+	u16 val16;
+	int ret;
+
+	if (off < 0)
+		return -EINVAL;
+
+	switch (len) {
 	case 1:
-		if (cmd == IOCTL_PCIDTF_READ_CFG)
-			ret = pci_read_config_byte(dev->pdev, data.off,
-						   (u8 *) & data.val);
-		else
-			ret = pci_write_config_byte(dev->pdev, data.off,
-						    data.val);
+		if (read) {
+			ret = pci_read_config_byte(dev->pdev, off, &val8);
+			*val = val8;
+		} else {
+			ret = pci_write_config_byte(dev->pdev, off, *val);
+		}
 		break;
 	case 2:
-		if (cmd == IOCTL_PCIDTF_READ_CFG)
-			ret = pci_read_config_word(dev->pdev, data.off,
-						   (u16 *) & data.val);
-		else
-			ret = pci_write_config_word(dev->pdev, data.off,
-						    data.val);
+		if (read) {
+			ret = pci_read_config_word(dev->pdev, off, &val16);
+			*val = val16;
+		} else {
+			ret = pci_write_config_word(dev->pdev, off, *val);
+		}
 		break;
 	case 4:
-		if (cmd == IOCTL_PCIDTF_READ_CFG)
-			ret = pci_read_config_dword(dev->pdev, data.off,
-						    &data.val);
+		if (read)
+			ret = pci_read_config_dword(dev->pdev, off, val);
 		else
-			ret = pci_write_config_dword(dev->pdev, data.off,
-						     data.val);
+			ret = pci_write_config_dword(dev->pdev, off, *val);
 		break;
 	default:
 		ret = -EINVAL;
+		break;
+	}
+	trace_cfg_access(dev->pdev, read, off, len, *val, ret);
+	return ret;
+}
+
+long pcidtf_rw_cfg(pcidtf_dev_t * dev, unsigned int cmd, unsigned long arg)
+{
+	PCIDTF_CFG_DATA data;
+	long ret = 0;
+
+	memset(&data, 0, sizeof(data));
+
+	if (copy_from_user(&data, (int __user *)arg, sizeof(data))) {
+		ret = -EFAULT;
 		goto done;
 	}
+	ret = pcidtf_cfg_rw(dev, cmd == IOCTL_PCIDTF_READ_CFG, data.off,
+			    data.len, &data.val);
+	if (ret)
+		goto done;
 	if (cmd == IOCTL_PCIDTF_WRITE_CFG)
 		goto done;
-	if (!access_ok(VERIFY_WRITE, (void __user *)arg, _IOC_SIZE(cmd))) {
+	if (copy_to_user((int __user *)arg, &data, sizeof(data))) {
 		ret = -EFAULT;
 		goto done;
 	}
-	if (copy_to_user((int __user *)arg, &data, sizeof(data))) {
+
+ done:
+	if (ret == 0)
+		pcidtf_count_bytes(dev, cmd, data.len);
+	return ret;
+}
+
+/*
+ * Read or write a range of configuration space. Each position is accessed
+ * with the widest naturally aligned access that fits in the range.
+ */
+long pcidtf_rw_cfg_block(pcidtf_dev_t * dev, unsigned int cmd,
+			 unsigned long arg)
+{
+	PCIDTF_CFG_BLOCK data;
+	unsigned char *buf = NULL;
+	int read = (cmd == IOCTL_PCIDTF_READ_CFG_BLOCK);
+	int pos, len;
+	u32 val;
+	long ret = 0;
+
+	if (copy_from_user(&data, (int __user *)arg, sizeof(data))) {
 		ret = -EFAULT;
 		goto done;
 	}
+	if (data.off < 0 || data.len <= 0 ||
+	    data.off >= dev->pdev->cfg_size ||
+	    data.len > dev->pdev->cfg_size - data.off) {
+		ret = -EINVAL;
+		goto done;
+	}
+	buf = kmalloc(data.len, GFP_KERNEL);
+	if (buf == NULL) {
+		ret = -ENOMEM;
+		goto done;
+	}
+	if (!read && copy_from_user(buf, data.buf, data.len)) {
+		ret = -EFAULT;
+		goto done;
+	}
+
+	for (pos = 0; pos < data.len; pos += len) {
+		if (((data.off + pos) & 3) == 0 && data.len - pos >= 4)
+			len = 4;
+		else if (((data.off + pos) & 1) == 0 && data.len - pos >= 2)
+			len = 2;
+		else
+			len = 1;
+		if (!read) {
+			if (len == 4)
+				val = get_unaligned_le32(buf + pos);
+			else if (len == 2)
+				val = get_unaligned_le16(buf + pos);
+			else
+				val = buf[pos];
+		}
+		ret = pcidtf_cfg_rw(dev, read, data.off + pos, len, &val);
+		if (ret)
+			goto done;
+		if (read) {
+			if (len == 4)
+				put_unaligned_le32(val, buf + pos);
+			else if (len == 2)
+				put_unaligned_le16(val, buf + pos);
+			else
+				buf[pos] = val;
+		}
+	}
+
+	if (read) {
+		if (copy_to_user(data.buf, buf, data.len)) {
+			ret = -EFAULT;
+			goto done;
+		}
+	}
+	pcidtf_count_bytes(dev, cmd, data.len);
 
  done:
+	if (buf)
+		kfree(buf);
 	return ret;
 }
 
@@ -129,10 +376,6 @@ long pcidtf_get_reg_info(pcidtf_dev_t * dev, unsigned long arg)
 	data.addr = iomap->start;
 	data.len = iomap->len;
 
-	if (!access_ok(VERIFY_WRITE, (void __user *)arg, sizeof(data))) {
-		ret = -EFAULT;
-		goto done;
-	}
 	if (copy_to_user((int __user *)arg, &data, sizeof(data))) {
 		ret = -EFAULT;
 		goto done;
@@ -141,11 +384,60 @@ long pcidtf_get_reg_info(pcidtf_dev_t * dev, unsigned long arg)
 	return ret;
 }
 
-long pcidtf_rw_reg(pcidtf_dev_t * dev, unsigned int cmd, unsigned long arg)
+int pcidtf_reg_rw(pcidtf_dev_t * dev, int read, int bar, int off, int len,
+		  u64 * val)
 {
-	PCIDTF_REG_DATA data;
 	pcidtf_iomap_t *iomap;
 	void __iomem *addr;
+	s64 start;
+
+	if (bar < 0 || bar >= dev->iomap_count)
+		return -EINVAL;
+	iomap = dev->iomap + bar;
+	if (off < 0 || off >= iomap->len || len > iomap->len - off)
+		return -EINVAL;
+	addr = (unsigned char *)iomap->addr + off;
+
+	start = pcidtf_lat_start();
+	switch (len) {
+	case 1:
+		if (read)
+			*val = ioread8(addr);
+		else
+			iowrite8(*val, addr);
+		break;
+	case 2:
+		if (read)
+			*val = ioread16(addr);
+		else
+			iowrite16(*val, addr);
+		break;
+	case 4:
+		if (read)
+			*val = ioread32(addr);
+		else
+			iowrite32(*val, addr);
+		break;
+	case 8:
+		/* 64-bit access is only possible on memory BARs */
+		if (!(iomap->flags & IORESOURCE_MEM))
+			return -EINVAL;
+		if (read)
+			*val = readq(addr);
+		else
+			writeq(*val, addr);
+		break;
+	default:
+		return -EINVAL;
+	}
+	pcidtf_lat_end(dev, read, bar, len, start);
+	trace_reg_access(dev->pdev, read, bar, off, len, *val);
+	return 0;
+}
+
+long pcidtf_rw_reg(pcidtf_dev_t * dev, unsigned int cmd, unsigned long arg)
+{
+	PCIDTF_REG_DATA data;
 	int ret = 0;
 
 	memset(&data, 0, sizeof(data));
@@ -154,48 +446,269 @@ long pcidtf_rw_reg(pcidtf_dev_t * dev, unsigned int cmd, unsigned long arg)
 		ret = -EFAULT;
 		goto done;
 	}
-	printk("IOCTL - cmd=0x%X, bar=%d, off=%d, len=%d\n", cmd, data.bar,
-	       data.off, data.len);
+	ret = pcidtf_reg_rw(dev, cmd == IOCTL_PCIDTF_READ_REG, data.bar,
+			    data.off, data.len, &data.val);
+	if (ret)
+		goto done;
+	if (cmd == IOCTL_PCIDTF_WRITE_REG)
+		goto done;
+	if (copy_to_user((int __user *)arg, &data, sizeof(data))) {
+		ret = -EFAULT;
+		goto done;
+	}
 
-	if (data.bar < 0 || data.bar >= dev->iomap_count) {
-		ret = -EINVAL;
+ done:
+	if (ret == 0)
+		pcidtf_count_bytes(dev, cmd, data.len);
+	return ret;
+}
+
+/*
+ * Read a register until (val & mask) == expect or the timeout (in
+ * microseconds) expires. The register is re-read immediately when interval
+ * is 0, otherwise the thread sleeps for interval microseconds between reads.
+ * The last value, the number of reads and the elapsed time in nanoseconds
+ * are returned even if the poll timed out.
+ */
+long pcidtf_poll_reg(pcidtf_dev_t * dev, unsigned long arg)
+{
+	PCIDTF_POLL_DATA data;
+	s64 start, now, deadline;
+	long ret = 0;
+
+	if (copy_from_user(&data, (int __user *)arg, sizeof(data))) {
+		ret = -EFAULT;
 		goto done;
 	}
-	iomap = dev->iomap + data.bar;
-	if (data.off < 0 || data.off + data.len >= iomap->len) {
+	if (data.timeout < 0 || data.interval < 0) {
 		ret = -EINVAL;
 		goto done;
 	}
-	addr = (unsigned char *)iomap->addr + data.off;
 
-	switch (data.len) {
+	data.count = 0;
+	start = ktime_to_ns(ktime_get());
+	deadline = start + (s64) data.timeout * NSEC_PER_USEC;
+	for (;;) {
+		ret = pcidtf_reg_rw(dev, 1, data.bar, data.off, data.len,
+				    &data.val);
+		if (ret)
+			break;
+		data.count++;
+		if ((data.val & data.mask) == data.expect)
+			break;
+		now = ktime_to_ns(ktime_get());
+		if (now >= deadline) {
+			ret = -ETIMEDOUT;
+			break;
+		}
+		if (signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		/* Long polls must not hold off pcidtf_remove() */
+		if (READ_ONCE(dev->dead)) {
+			ret = -ENODEV;
+			break;
+		}
+		if (data.interval == 0)
+			cpu_relax();
+		else if (data.interval < 10)
+			udelay(data.interval);
+		else
+			usleep_range(data.interval,
+				     data.interval + (data.interval >> 2));
+		cond_resched();
+	}
+	data.elapsed = ktime_to_ns(ktime_get()) - start;
+
+	if (copy_to_user((int __user *)arg, &data, sizeof(data))) {
+		ret = -EFAULT;
+		goto done;
+	}
+
+ done:
+	return ret;
+}
+
+static void pcidtf_block_io(void __iomem * addr, void *buf, int len,
+			    int width, int read)
+{
+	switch (width) {
 	case 1:
-		if (cmd == IOCTL_PCIDTF_READ_REG)
-			data.val = ioread8(addr);
+		if (read)
+			ioread8_rep(addr, buf, len);
 		else
-			iowrite8(data.val, addr);
+			iowrite8_rep(addr, buf, len);
 		break;
 	case 2:
-		if (cmd == IOCTL_PCIDTF_READ_REG)
-			data.val = ioread16(addr);
+		if (read)
+			ioread16_rep(addr, buf, len >> 1);
 		else
-			iowrite16(data.val, addr);
+			iowrite16_rep(addr, buf, len >> 1);
 		break;
 	case 4:
-		if (cmd == IOCTL_PCIDTF_READ_REG)
-			data.val = ioread32(addr);
+		if (read)
+			ioread32_rep(addr, buf, len >> 2);
 		else
-			iowrite32(data.val, addr);
+			iowrite32_rep(addr, buf, len >> 2);
 		break;
 	default:
+		if (read)
+			memcpy_fromio(buf, addr, len);
+		else
+			memcpy_toio(addr, buf, len);
+		break;
+	}
+}
+
+/*
+ * Transfer a block of data between a BAR and a user buffer. Width 0 copies
+ * an address range of a memory BAR, and width 1, 2 or 4 repeats accesses of
+ * that size to a single FIFO register.
+ */
+long pcidtf_rw_block(pcidtf_dev_t * dev, unsigned int cmd, unsigned long arg)
+{
+	PCIDTF_BLOCK_DATA data;
+	pcidtf_iomap_t *iomap;
+	void __iomem *addr;
+	unsigned char __user *ubuf;
+	void *buf = NULL;
+	int read = (cmd == IOCTL_PCIDTF_READ_BLOCK);
+	int done, chunk;
+	long ret = 0;
+
+	if (copy_from_user(&data, (int __user *)arg, sizeof(data))) {
+		ret = -EFAULT;
+		goto done;
+	}
+
+	if (data.bar < 0 || data.bar >= dev->iomap_count) {
 		ret = -EINVAL;
 		goto done;
+	}
+	iomap = dev->iomap + data.bar;
+	if (data.off < 0 || data.off >= iomap->len || data.len <= 0) {
+		ret = -EINVAL;
+		goto done;
+	}
+	switch (data.width) {
+	case 0:
+		if (!(iomap->flags & IORESOURCE_MEM) ||
+		    data.len > iomap->len - data.off) {
+			ret = -EINVAL;
+			goto done;
+		}
+		break;
+	case 1:
+	case 2:
+	case 4:
+		if (data.width > iomap->len - data.off ||
+		    (data.len % data.width) != 0) {
+			ret = -EINVAL;
+			goto done;
+		}
 		break;
+	default:
+		ret = -EINVAL;
+		goto done;
 	}
 
-	if (cmd == IOCTL_PCIDTF_WRITE_REG)
+	ubuf = data.buf;
+	if (!pcidtf_access_ok(read ? VERIFY_WRITE : VERIFY_READ, ubuf,
+			      data.len)) {
+		ret = -EFAULT;
 		goto done;
-	if (!access_ok(VERIFY_WRITE, (void __user *)arg, _IOC_SIZE(cmd))) {
+	}
+	buf = kmalloc(min(data.len, PCIDTF_BLOCK_CHUNK), GFP_KERNEL);
+	if (buf == NULL) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	addr = (unsigned char *)iomap->addr + data.off;
+	for (done = 0; done < data.len; done += chunk) {
+		chunk = min(data.len - done, PCIDTF_BLOCK_CHUNK);
+		if (!read && copy_from_user(buf, ubuf + done, chunk)) {
+			ret = -EFAULT;
+			goto done;
+		}
+		pcidtf_block_io(data.width ? addr :
+				(unsigned char *)addr + done, buf, chunk,
+				data.width, read);
+		if (read && copy_to_user(ubuf + done, buf, chunk)) {
+			ret = -EFAULT;
+			goto done;
+		}
+		cond_resched();
+	}
+	pcidtf_count_bytes(dev, cmd, data.len);
+
+ done:
+	if (buf)
+		kfree(buf);
+	return ret;
+}
+
+long pcidtf_exec_batch(pcidtf_dev_t * dev, unsigned long arg)
+{
+	PCIDTF_BATCH_DATA data;
+	PCIDTF_BATCH_OP *ops = NULL, *op;
+	size_t size;
+	u32 val;
+	int i;
+	long ret = 0;
+
+	if (copy_from_user(&data, (int __user *)arg, sizeof(data))) {
+		ret = -EFAULT;
+		goto done;
+	}
+	if (data.count <= 0 || data.count > PCIDTF_MAX_BATCH_OPS) {
+		ret = -EINVAL;
+		goto done;
+	}
+	size = sizeof(PCIDTF_BATCH_OP) * data.count;
+	ops = kmalloc(size, GFP_KERNEL);
+	if (ops == NULL) {
+		ret = -ENOMEM;
+		goto done;
+	}
+	if (copy_from_user(ops, (void __user *)data.ops, size)) {
+		ret = -EFAULT;
+		goto done;
+	}
+
+	/* Execute operations in order and stop at the first failure */
+	for (i = 0, op = ops; i < data.count; i++, op++) {
+		switch (op->type) {
+		case PCIDTF_BATCH_READ_CFG:
+			ret = pcidtf_cfg_rw(dev, 1, op->off, op->len, &val);
+			op->val = val;
+			break;
+		case PCIDTF_BATCH_WRITE_CFG:
+			val = op->val;
+			ret = pcidtf_cfg_rw(dev, 0, op->off, op->len, &val);
+			break;
+		case PCIDTF_BATCH_READ_REG:
+			ret = pcidtf_reg_rw(dev, 1, op->bar, op->off, op->len,
+					    &op->val);
+			break;
+		case PCIDTF_BATCH_WRITE_REG:
+			ret = pcidtf_reg_rw(dev, 0, op->bar, op->off, op->len,
+					    &op->val);
+			break;
+		default:
+			ret = -EINVAL;
+			break;
+		}
+		if (ret)
+			break;
+		pcidtf_count_bytes(dev, IOCTL_PCIDTF_BATCH, op->len);
+	}
+	data.done = i;
+
+	if (data.done > 0 &&
+	    copy_to_user((void __user *)data.ops, ops,
+			 sizeof(PCIDTF_BATCH_OP) * data.done)) {
 		ret = -EFAULT;
 		goto done;
 	}
@@ -205,14 +718,68 @@ long pcidtf_rw_reg(pcidtf_dev_t * dev, unsigned int cmd, unsigned long arg)
 	}
 
  done:
+	if (ops)
+		kfree(ops);
 	return ret;
 }
 
-long pcidtf_alloc_dma(pcidtf_dev_t * dev, unsigned long arg)
+pcidtf_dma_t *pcidtf_new_dma(pcidtf_dev_t * dev, int type, int len)
+{
+	pcidtf_dma_t *dma;
+
+	dma = kzalloc(sizeof(pcidtf_dma_t), GFP_KERNEL);
+	if (dma != NULL) {
+		kref_init(&dma->ref);
+		dma->pdev = pci_dev_get(dev->pdev);
+		dma->type = type;
+		dma->len = len;
+	}
+	return dma;
+}
+
+/*
+ * Assign an ID to a DMA buffer and make it visible to lookups. The ID is
+ * returned, since the buffer may be freed by another thread right away.
+ */
+int pcidtf_add_dma(pcidtf_dev_t * dev, pcidtf_dma_t * dma)
+{
+	int id;
+
+	idr_preload(GFP_KERNEL);
+	spin_lock(&dev->dma_lock);
+	id = idr_alloc(&dev->dma_idr, dma, 1, 0, GFP_NOWAIT);
+	if (id > 0)
+		dma->id = id;
+	spin_unlock(&dev->dma_lock);
+	idr_preload_end();
+	return id;
+}
+
+/*
+ * Allocate a streaming DMA buffer from normal cacheable pages. The CPU and
+ * the device see the same data only after IOCTL_PCIDTF_SYNC_DMA.
+ */
+static int pcidtf_alloc_stream(pcidtf_dev_t * dev, pcidtf_dma_t * dma)
+{
+	dma->vaddr = alloc_pages_exact(dma->len, GFP_KERNEL | __GFP_ZERO);
+	if (dma->vaddr == NULL)
+		return -ENOMEM;
+	dma->paddr = dma_map_single(&dev->pdev->dev, dma->vaddr, dma->len,
+				    DMA_BIDIRECTIONAL);
+	if (dma_mapping_error(&dev->pdev->dev, dma->paddr)) {
+		free_pages_exact(dma->vaddr, dma->len);
+		dma->vaddr = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+long pcidtf_alloc_dma(pcidtf_dev_t * dev, unsigned int cmd, unsigned long arg)
 {
 	PCIDTF_DMA_INFO data;
 	pcidtf_dma_t *dma = NULL;
-	int i, new_count;
+	void *vaddr;
+	int id = 0;
 	long ret = 0;
 
 	memset(&data, 0, sizeof(data));
@@ -221,95 +788,216 @@ long pcidtf_alloc_dma(pcidtf_dev_t * dev, unsigned long arg)
 		ret = -EFAULT;
 		goto done;
 	}
+	if (data.len <= 0) {
+		ret = -EINVAL;
+		goto done;
+	}
 
-	for (i = 0; i < dev->dma_count; i++) {
-		if (dev->dma[i].vaddr == NULL) {
-			dma = &dev->dma[i];
-			break;
+	if (cmd == IOCTL_PCIDTF_ALLOC_STREAM_DMA) {
+		dma = pcidtf_new_dma(dev, PCIDTF_DMA_STREAM, data.len);
+		if (dma == NULL) {
+			ret = -ENOMEM;
+			goto done;
 		}
-	}
-	if (dma == NULL) {
-		new_count = dev->dma_count << 1;
-		dma =
-		    kmalloc(sizeof(pcidtf_dma_t) * dev->dma_count, GFP_KERNEL);
+		ret = pcidtf_alloc_stream(dev, dma);
+		if (ret)
+			goto done;
+	} else {
+		dma = pcidtf_new_dma(dev, PCIDTF_DMA_COHERENT, data.len);
 		if (dma == NULL) {
 			ret = -ENOMEM;
 			goto done;
 		}
-		memcpy(dma, dev->dma, sizeof(pcidtf_dma_t) * dev->dma_count);
-		kfree(dev->dma);
-		dev->dma = dma;
-		dma = &dma[dev->dma_count];
-		dev->dma_count = new_count;
+		dma->vaddr = pcidtf_pool_alloc(dev->pool, data.len,
+					       &dma->paddr);
+		if (dma->vaddr == NULL) {
+			ret = -ENOMEM;
+			goto done;
+		}
+		dma->pool = dev->pool;
 	}
-
-	dma->vaddr = pci_alloc_consistent(dev->pdev, data.len, &dma->paddr);
-	if (dma->vaddr == NULL) {
-		ret = -ENOMEM;
+	data.addr = dma->paddr;
+	vaddr = dma->vaddr;
+	/* Another thread may free the buffer as soon as its ID is published */
+	ret = pcidtf_add_dma(dev, dma);
+	if (ret < 0)
 		goto done;
-	}
-	dma->len = data.len;
+	data.id = id = ret;
+	ret = 0;
+	dma = NULL;
 
 	printk
-	    ("DMA buffer allocated (idx %d, len %u, vaddr 0x%p, paddr 0x%llX)\n",
-	     i, dma->len, dma->vaddr, dma->paddr);
+	    ("DMA buffer allocated (id %d, len %u, vaddr 0x%p, paddr 0x%llX)\n",
+	     data.id, data.len, vaddr, data.addr);
 
-	data.id = i + 1;
-	data.addr = dma->paddr;
-
-	if (!access_ok(VERIFY_WRITE, (void __user *)arg, sizeof(data))) {
-		ret = -EFAULT;
-		goto done;
-	}
 	if (copy_to_user((int __user *)arg, &data, sizeof(data))) {
 		ret = -EFAULT;
 		goto done;
 	}
 
  done:
+	if (ret) {
+		if (id)
+			pcidtf_remove_dma(dev, id, NULL);
+		else if (dma)
+			pcidtf_put_dma(dma);
+	}
 	return ret;
 }
 
+static void pcidtf_release_dma(struct kref *ref)
+{
+	pcidtf_dma_t *dma = container_of(ref, pcidtf_dma_t, ref);
+
+	if (dma->type == PCIDTF_DMA_USER) {
+		pcidtf_release_user_dma(dma);
+	} else if (dma->type == PCIDTF_DMA_STREAM && dma->vaddr) {
+		dma_unmap_single(&dma->pdev->dev, dma->paddr, dma->len,
+				 DMA_BIDIRECTIONAL);
+		free_pages_exact(dma->vaddr, dma->len);
+	} else if (dma->vaddr) {
+		printk
+		    ("Free DMA buffer (id %d, len %u, vaddr 0x%p, paddr 0x%llX)\n",
+		     dma->id, dma->len, dma->vaddr, dma->paddr);
+		pcidtf_pool_free(dma->pool, dma->len, dma->vaddr, dma->paddr);
+	}
+	pci_dev_put(dma->pdev);
+	kfree_rcu(dma, rcu);
+}
+
+/*
+ * Look up a DMA buffer by ID without taking a lock. The caller must release
+ * the returned buffer by pcidtf_put_dma().
+ */
 pcidtf_dma_t *pcidtf_get_dma(pcidtf_dev_t * dev, int id)
 {
 	pcidtf_dma_t *dma;
 
-	if (dev->dma == NULL || id <= 0 || id > dev->dma_count)
+	if (id <= 0)
 		return NULL;
-	dma = &dev->dma[id - 1];
-	return (dma->vaddr ? dma : NULL);
+	rcu_read_lock();
+	dma = idr_find(&dev->dma_idr, id);
+	if (dma && !kref_get_unless_zero(&dma->ref))
+		dma = NULL;
+	rcu_read_unlock();
+	return dma;
 }
 
-long pcidtf_free_dma(pcidtf_dev_t * dev, unsigned long arg)
+void pcidtf_put_dma(pcidtf_dma_t * dma)
+{
+	kref_put(&dma->ref, pcidtf_release_dma);
+}
+
+/*
+ * Remove a DMA buffer from the ID table. The buffer is freed when the last
+ * reference (including user-space mappings) is dropped. A user buffer
+ * registered through the given file is returned to its registration cache.
+ */
+int pcidtf_remove_dma(pcidtf_dev_t * dev, int id, pcidtf_file_t * file)
 {
-	int id = 0;
 	pcidtf_dma_t *dma;
+
+	if (id <= 0)
+		return -EINVAL;
+	spin_lock(&dev->dma_lock);
+	dma = idr_find(&dev->dma_idr, id);
+	if (dma) {
+		idr_remove(&dev->dma_idr, id);
+		if (file && dma->owner != file)
+			file = NULL;
+	}
+	spin_unlock(&dev->dma_lock);
+	if (dma == NULL)
+		return -EINVAL;
+	if (file && dma->type == PCIDTF_DMA_USER)
+		pcidtf_put_ucache(file, dma);
+	pcidtf_put_dma(dma);
+	return 0;
+}
+
+long pcidtf_free_dma(pcidtf_file_t * file, unsigned long arg)
+{
+	int id = 0;
 	long ret = 0;
 
 	if (copy_from_user(&id, (int __user *)arg, sizeof(id))) {
 		ret = -EFAULT;
 		goto done;
 	}
-	dma = pcidtf_get_dma(dev, id);
+	ret = pcidtf_remove_dma(file->dev, id, file);
+
+ done:
+	return ret;
+}
+
+/* Transfer ownership of a range of a non-coherent buffer */
+static void pcidtf_sync_dma_range(pcidtf_dev_t * dev, pcidtf_dma_t * dma,
+				  int off, int len, int dir)
+{
+	struct device *d = &dev->pdev->dev;
+
+	switch (dma->type) {
+	case PCIDTF_DMA_STREAM:
+		if (dir == PCIDTF_SYNC_FOR_CPU)
+			dma_sync_single_range_for_cpu(d, dma->paddr, off, len,
+						      DMA_BIDIRECTIONAL);
+		else
+			dma_sync_single_range_for_device(d, dma->paddr, off,
+							 len,
+							 DMA_BIDIRECTIONAL);
+		break;
+	case PCIDTF_DMA_USER:
+		/* Segments do not follow buffer offsets, so sync them all */
+		if (dir == PCIDTF_SYNC_FOR_CPU)
+			dma_sync_sg_for_cpu(d, dma->sgt.sgl,
+					    dma->sgt.orig_nents,
+					    DMA_BIDIRECTIONAL);
+		else
+			dma_sync_sg_for_device(d, dma->sgt.sgl,
+					       dma->sgt.orig_nents,
+					       DMA_BIDIRECTIONAL);
+		break;
+	default:
+		break;
+	}
+}
+
+long pcidtf_sync_dma(pcidtf_dev_t * dev, unsigned long arg)
+{
+	PCIDTF_DMA_SYNC data;
+	pcidtf_dma_t *dma = NULL;
+	long ret = 0;
+
+	if (copy_from_user(&data, (int __user *)arg, sizeof(data))) {
+		ret = -EFAULT;
+		goto done;
+	}
+	dma = pcidtf_get_dma(dev, data.id);
 	if (dma == NULL) {
 		ret = -EINVAL;
 		goto done;
 	}
-
-	printk("Free DMA buffer (idx %d, len %u, vaddr 0x%p, paddr 0x%llX)\n",
-	       id - 1, dma->len, dma->vaddr, dma->paddr);
-	pci_free_consistent(dev->pdev, dma->len, dma->vaddr, dma->paddr);
-	dma->vaddr = NULL;
+	if (data.off < 0 || data.off > dma->len || data.len < 0 ||
+	    data.len > dma->len - data.off ||
+	    (data.dir != PCIDTF_SYNC_FOR_DEVICE &&
+	     data.dir != PCIDTF_SYNC_FOR_CPU)) {
+		ret = -EINVAL;
+		goto done;
+	}
+	pcidtf_sync_dma_range(dev, dma, data.off, data.len, data.dir);
 
  done:
+	if (dma)
+		pcidtf_put_dma(dma);
 	return ret;
 }
 
 long pcidtf_rw_dma(pcidtf_dev_t * dev, unsigned int cmd, unsigned long arg)
 {
 	PCIDTF_DMA_DATA data;
-	pcidtf_dma_t *dma;
+	pcidtf_dma_t *dma = NULL;
 	unsigned char *bp;
+	int read;
 	long ret = 0;
 
 	memset(&data, 0, sizeof(data));
@@ -319,49 +1007,55 @@ long pcidtf_rw_dma(pcidtf_dev_t * dev, unsigned int cmd, unsigned long arg)
 		goto done;
 	}
 
-	printk("id=%d, off=%d, len=%d\n", data.id, data.off, data.len);
-
 	dma = pcidtf_get_dma(dev, data.id);
 	if (dma == NULL) {
 		ret = -EINVAL;
 		goto done;
 	}
 
-	if (data.off + data.len > dma->len) {
+	if (data.off < 0 || data.off > dma->len || data.len < 0 ||
+	    data.len > dma->len - data.off) {
 		printk("Invalid param - off %d, len %d (%u)\n", data.off,
 		       data.len, dma->len);
 		ret = -EINVAL;
 		goto done;
 	}
 
-	bp = (unsigned char *)dma->vaddr + data.off;
-	if (cmd == IOCTL_PCIDTF_READ_DMA) {
-		if (!access_ok(VERIFY_READ, data.buf, data.len)) {
-			ret = -EFAULT;
-			goto done;
-		}
-		if (copy_to_user(data.buf, bp, data.len)) {
-			ret = -EFAULT;
-			goto done;
-		}
+	trace_dma_copy(dev->pdev, cmd == IOCTL_PCIDTF_READ_DMA, data.id,
+		       data.off, data.len);
+
+	/* Every buffer type is handed over around the copy */
+	read = (cmd == IOCTL_PCIDTF_READ_DMA);
+	if (read)
+		pcidtf_sync_dma_range(dev, dma, data.off, data.len,
+				      PCIDTF_SYNC_FOR_CPU);
+	if (dma->type == PCIDTF_DMA_USER) {
+		ret = pcidtf_copy_user_dma(dma, read, data.off, data.buf,
+					   data.len);
 	} else {
-		if (!access_ok(VERIFY_WRITE, data.buf, data.len)) {
-			ret = -EFAULT;
-			goto done;
-		}
-		if (copy_from_user(bp, data.buf, data.len)) {
-			ret = -EFAULT;
-			goto done;
-		}
+		bp = (unsigned char *)dma->vaddr + data.off;
+		if (read)
+			ret = copy_to_user(data.buf, bp, data.len) ? -EFAULT : 0;
+		else
+			ret = copy_from_user(bp, data.buf, data.len) ?
+			    -EFAULT : 0;
 	}
+	if (ret)
+		goto done;
+	if (!read)
+		pcidtf_sync_dma_range(dev, dma, data.off, data.len,
+				      PCIDTF_SYNC_FOR_DEVICE);
+	pcidtf_count_bytes(dev, cmd, data.len);
  done:
+	if (dma)
+		pcidtf_put_dma(dma);
 	return ret;
 }
 
 long pcidtf_get_dma_info(pcidtf_dev_t * dev, unsigned long arg)
 {
 	PCIDTF_DMA_INFO req;
-	pcidtf_dma_t *dma;
+	pcidtf_dma_t *dma = NULL;
 	long ret = 0;
 
 	if (copy_from_user(&req, (int __user *)arg, sizeof(req))) {
@@ -375,29 +1069,47 @@ long pcidtf_get_dma_info(pcidtf_dev_t * dev, unsigned long arg)
 	}
 	req.len = dma->len;
 	req.addr = dma->paddr;
-	if (!access_ok(VERIFY_WRITE, (void __user *)arg, sizeof(req))) {
-		ret = -EFAULT;
-		goto done;
-	}
 	if (copy_to_user((int __user *)arg, &req, sizeof(req))) {
 		ret = -EFAULT;
 		goto done;
 	}
  done:
+	if (dma)
+		pcidtf_put_dma(dma);
 	return ret;
 }
 
 long pcidtf_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-	pcidtf_dev_t *dev = filp->private_data;
+	pcidtf_file_t *file = filp->private_data;
+	pcidtf_dev_t *dev = file->dev;
+	s64 start = ktime_to_ns(ktime_get());
 	long ret = 0;
 
+	/* The device stays usable until pcidtf_remove() marks it dead */
+	down_read(&dev->remove_lock);
+	if (dev->dead) {
+		ret = -ENODEV;
+		goto out;
+	}
+
 	if (cmd == IOCTL_PCIDTF_GET_INFO) {
 		ret = pcidtf_get_info(dev, arg);
 		goto done;
 	}
 
-	if (!access_ok(VERIFY_READ, (void __user *)arg, _IOC_SIZE(cmd))) {
+	/*
+	 * Descriptors grow by appending fields, which changes the size in the
+	 * ioctl code, so any size is accepted. The size is checked by
+	 * pcidtf_get_desc().
+	 */
+	if (_IOC_TYPE(cmd) == IOC_PCIDTF &&
+	    _IOC_NR(cmd) == _IOC_NR(IOCTL_PCIDTF_GET_DESC) &&
+	    _IOC_DIR(cmd) == _IOC_DIR(IOCTL_PCIDTF_GET_DESC))
+		cmd = IOCTL_PCIDTF_GET_DESC;
+
+	if (!pcidtf_access_ok(VERIFY_READ, (void __user *)arg,
+			      _IOC_SIZE(cmd))) {
 		ret = -EFAULT;
 		goto done;
 	}
@@ -407,6 +1119,10 @@ long pcidtf_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	case IOCTL_PCIDTF_WRITE_CFG:
 		ret = pcidtf_rw_cfg(dev, cmd, arg);
 		break;
+	case IOCTL_PCIDTF_READ_CFG_BLOCK:
+	case IOCTL_PCIDTF_WRITE_CFG_BLOCK:
+		ret = pcidtf_rw_cfg_block(dev, cmd, arg);
+		break;
 	case IOCTL_PCIDTF_GET_REG:
 		ret = pcidtf_get_reg_info(dev, arg);
 		break;
@@ -415,10 +1131,14 @@ long pcidtf_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		ret = pcidtf_rw_reg(dev, cmd, arg);
 		break;
 	case IOCTL_PCIDTF_ALLOC_DMA:
-		ret = pcidtf_alloc_dma(dev, arg);
+	case IOCTL_PCIDTF_ALLOC_STREAM_DMA:
+		ret = pcidtf_alloc_dma(dev, cmd, arg);
+		break;
+	case IOCTL_PCIDTF_SYNC_DMA:
+		ret = pcidtf_sync_dma(dev, arg);
 		break;
 	case IOCTL_PCIDTF_FREE_DMA:
-		ret = pcidtf_free_dma(dev, arg);
+		ret = pcidtf_free_dma(file, arg);
 		break;
 	case IOCTL_PCIDTF_READ_DMA:
 	case IOCTL_PCIDTF_WRITE_DMA:
@@ -427,11 +1147,107 @@ long pcidtf_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	case IOCTL_PCIDTF_GET_DMA_INFO:
 		ret = pcidtf_get_dma_info(dev, arg);
 		break;
+	case IOCTL_PCIDTF_MAP_USER:
+		ret = pcidtf_map_user(file, arg);
+		break;
+	case IOCTL_PCIDTF_GET_POOL_STATS:
+		ret = pcidtf_get_pool_stats(dev, arg);
+		break;
+	case IOCTL_PCIDTF_BATCH:
+		ret = pcidtf_exec_batch(dev, arg);
+		break;
+	case IOCTL_PCIDTF_POLL_REG:
+		ret = pcidtf_poll_reg(dev, arg);
+		break;
+	case IOCTL_PCIDTF_SET_IRQ:
+		ret = pcidtf_set_irq(dev, arg);
+		break;
+	case IOCTL_PCIDTF_SET_IRQ_EVENT:
+		ret = pcidtf_set_irq_event(dev, arg);
+		break;
+	case IOCTL_PCIDTF_WAIT_IRQ:
+		ret = pcidtf_wait_irq(dev, arg);
+		break;
+	case IOCTL_PCIDTF_UNMASK_IRQ:
+		ret = pcidtf_unmask_irq(dev, arg);
+		break;
+	case IOCTL_PCIDTF_READ_BLOCK:
+	case IOCTL_PCIDTF_WRITE_BLOCK:
+		ret = pcidtf_rw_block(dev, cmd, arg);
+		break;
+	case IOCTL_PCIDTF_LOAD_PROG:
+		ret = pcidtf_load_prog(file, arg);
+		break;
+	case IOCTL_PCIDTF_RUN_PROG:
+		ret = pcidtf_run_prog(file, arg);
+		break;
+	case IOCTL_PCIDTF_FREE_PROG:
+		ret = pcidtf_free_prog(file, arg);
+		break;
+	case IOCTL_PCIDTF_GET_REG_STATS:
+		ret = pcidtf_get_reg_stats(dev, arg);
+		break;
+	case IOCTL_PCIDTF_RESET_REG_STATS:
+		ret = pcidtf_reset_reg_stats(dev, arg);
+		break;
+	case IOCTL_PCIDTF_GET_STATS:
+		ret = pcidtf_get_stats(dev, arg);
+		break;
+	case IOCTL_PCIDTF_RUN_BENCH:
+		ret = pcidtf_run_bench(dev, arg);
+		break;
+	case IOCTL_PCIDTF_GET_DESC:
+		ret = pcidtf_get_desc(dev, arg);
+		break;
 	default:
 		ret = -ENOTTY;
-		break;
+		goto out;
 	}
 
  done:
+	pcidtf_count_op(dev, cmd, ret, start);
+ out:
+	up_read(&dev->remove_lock);
 	return ret;
 }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+/*
+ * Handle an io_uring passthrough command. Register and configuration space
+ * accesses complete inline, while commands that may sleep are retried by
+ * io_uring from a worker thread.
+ */
+int pcidtf_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+	const PCIDTF_URING_CMD *cmd = io_uring_sqe_cmd(ioucmd->sqe);
+#else
+	const PCIDTF_URING_CMD *cmd = ioucmd->cmd;
+#endif
+	unsigned long arg = (unsigned long)READ_ONCE(cmd->arg);
+
+	switch (ioucmd->cmd_op) {
+	case IOCTL_PCIDTF_READ_CFG:
+	case IOCTL_PCIDTF_WRITE_CFG:
+	case IOCTL_PCIDTF_READ_REG:
+	case IOCTL_PCIDTF_WRITE_REG:
+		break;
+	case IOCTL_PCIDTF_READ_CFG_BLOCK:
+	case IOCTL_PCIDTF_WRITE_CFG_BLOCK:
+	case IOCTL_PCIDTF_READ_BLOCK:
+	case IOCTL_PCIDTF_WRITE_BLOCK:
+	case IOCTL_PCIDTF_BATCH:
+	case IOCTL_PCIDTF_POLL_REG:
+	case IOCTL_PCIDTF_READ_DMA:
+	case IOCTL_PCIDTF_WRITE_DMA:
+	case IOCTL_PCIDTF_SYNC_DMA:
+	case IOCTL_PCIDTF_RUN_PROG:
+		if (issue_flags & IO_URING_F_NONBLOCK)
+			return -EAGAIN;
+		break;
+	default:
+		return -ENOTTY;
+	}
+	return pcidtf_ioctl(ioucmd->file, ioucmd->cmd_op, arg);
+}
+#endif
@@ -0,0 +1,389 @@
+/*
+ * PCI Device Test Framework
+ * This file implements interrupt functions.
+ *
+ * Copyright (C) 2013 Hiromitsu Sakamoto
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ */
+
+#include <linux/pci.h>
+#include <linux/fs.h>
+#include <linux/interrupt.h>
+#include <linux/eventfd.h>
+#include <linux/poll.h>
+#include <linux/sched.h>
+#include <linux/ktime.h>
+#include <linux/version.h>
+#include <asm/uaccess.h>
+
+#include "pcidtf.h"
+#include "pcidtf_ioctl.h"
+
+static inline int pcidtf_irq_changed(pcidtf_dev_t * dev, pcidtf_irq_t * vec,
+				     int index, u64 count)
+{
+	return (u64)atomic64_read(&vec->count) != count ||
+	    index >= READ_ONCE(dev->irq_count) || READ_ONCE(dev->dead);
+}
+
+/* Record an interrupt of a vector and notify its waiters */
+static void pcidtf_irq_signal(pcidtf_irq_t * vec)
+{
+	pcidtf_dev_t *dev = vec->dev;
+	struct eventfd_ctx *trigger;
+
+	vec->timestamp = ktime_to_ns(ktime_get());
+	atomic64_inc(&vec->count);
+	atomic64_inc(&dev->irq_events);
+
+	trigger = READ_ONCE(vec->trigger);
+	if (trigger) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+		eventfd_signal(trigger);
+#else
+		eventfd_signal(trigger, 1);
+#endif
+	}
+	wake_up_interruptible_all(&dev->irq_wq);
+}
+
+static irqreturn_t pcidtf_irq_handler(int irq, void *arg)
+{
+	pcidtf_irq_t *vec = arg;
+	pcidtf_dev_t *dev = vec->dev;
+
+	/* INTx may be shared, so claim it only if our device asserted it */
+	if (dev->irq_type == PCIDTF_IRQ_INTX &&
+	    !pci_check_and_mask_intx(dev->pdev))
+		return IRQ_NONE;
+
+	pcidtf_irq_signal(vec);
+	return IRQ_HANDLED;
+}
+
+/* Release all vectors. The caller must hold irq_lock. */
+static void pcidtf_free_irq(pcidtf_dev_t * dev)
+{
+	pcidtf_irq_t *vec;
+	int i;
+
+	for (i = 0, vec = dev->irq; i < dev->irq_count; i++, vec++) {
+		free_irq(vec->irq, vec);
+		if (vec->trigger) {
+			eventfd_ctx_put(vec->trigger);
+			vec->trigger = NULL;
+		}
+	}
+	if (dev->irq_type == PCIDTF_IRQ_MSIX)
+		pci_disable_msix(dev->pdev);
+	else if (dev->irq_type == PCIDTF_IRQ_MSI)
+		pci_disable_msi(dev->pdev);
+	else if (dev->irq_type == PCIDTF_IRQ_INTX)
+		/* The handler may have left INTx masked in the command register */
+		pci_intx(dev->pdev, 1);
+	dev->irq_type = PCIDTF_IRQ_NONE;
+	dev->irq_count = 0;
+	wake_up_interruptible_all(&dev->irq_wq);
+}
+
+/* Allocate vectors of the given type, falling back if type is AUTO */
+static int pcidtf_alloc_irq(pcidtf_dev_t * dev, int type, int count)
+{
+	struct pci_dev *pdev = dev->pdev;
+	pcidtf_irq_t *vec;
+	int i, ret;
+
+	if (type == PCIDTF_IRQ_AUTO || type == PCIDTF_IRQ_MSIX) {
+		for (i = 0; i < count; i++)
+			dev->msix[i].entry = i;
+		ret = pci_enable_msix_range(pdev, dev->msix, 1, count);
+		if (ret > 0) {
+			dev->irq_type = PCIDTF_IRQ_MSIX;
+			for (i = 0; i < ret; i++)
+				dev->irq[i].irq = dev->msix[i].vector;
+			count = ret;
+			goto request;
+		}
+	}
+	if ((type == PCIDTF_IRQ_AUTO || type == PCIDTF_IRQ_MSI) &&
+	    pci_enable_msi(pdev) == 0) {
+		dev->irq_type = PCIDTF_IRQ_MSI;
+		dev->irq[0].irq = pdev->irq;
+		count = 1;
+		goto request;
+	}
+	if ((type == PCIDTF_IRQ_AUTO || type == PCIDTF_IRQ_INTX) && pdev->irq) {
+		dev->irq_type = PCIDTF_IRQ_INTX;
+		dev->irq[0].irq = pdev->irq;
+		count = 1;
+		goto request;
+	}
+	return -ENODEV;
+
+ request:
+	for (i = 0, vec = dev->irq; i < count; i++, vec++) {
+		ret = request_irq(vec->irq, pcidtf_irq_handler,
+				  dev->irq_type == PCIDTF_IRQ_INTX ?
+				  IRQF_SHARED : 0, "pcidtf", vec);
+		if (ret) {
+			dev->irq_count = i;
+			pcidtf_free_irq(dev);
+			return ret;
+		}
+		dev->irq_count = i + 1;
+	}
+	if (dev->irq_type == PCIDTF_IRQ_INTX)
+		pci_intx(pdev, 1);
+	printk("Interrupt enabled (type %d, count %d)\n", dev->irq_type,
+	       dev->irq_count);
+	return 0;
+}
+
+void pcidtf_init_irq(pcidtf_dev_t * dev)
+{
+	int i;
+
+	mutex_init(&dev->irq_lock);
+	init_waitqueue_head(&dev->irq_wq);
+	atomic64_set(&dev->irq_events, 0);
+	for (i = 0; i < PCIDTF_MAX_IRQS; i++) {
+		dev->irq[i].dev = dev;
+		atomic64_set(&dev->irq[i].count, 0);
+	}
+}
+
+void pcidtf_disable_irq(pcidtf_dev_t * dev)
+{
+	mutex_lock(&dev->irq_lock);
+	pcidtf_free_irq(dev);
+	mutex_unlock(&dev->irq_lock);
+}
+
+long pcidtf_set_irq(pcidtf_dev_t * dev, unsigned long arg)
+{
+	PCIDTF_IRQ_CONFIG data;
+	long ret = 0;
+
+	if (copy_from_user(&data, (int __user *)arg, sizeof(data))) {
+		ret = -EFAULT;
+		goto done;
+	}
+	if (data.type < PCIDTF_IRQ_AUTO || data.type > PCIDTF_IRQ_INTX ||
+	    data.count < 0 || data.count > PCIDTF_MAX_IRQS) {
+		ret = -EINVAL;
+		goto done;
+	}
+
+	mutex_lock(&dev->irq_lock);
+	pcidtf_free_irq(dev);
+	if (data.count > 0)
+		ret = pcidtf_alloc_irq(dev, data.type, data.count);
+	data.type = dev->irq_type;
+	data.count = dev->irq_count;
+	mutex_unlock(&dev->irq_lock);
+	if (ret)
+		goto done;
+
+	if (copy_to_user((int __user *)arg, &data, sizeof(data))) {
+		ret = -EFAULT;
+		goto done;
+	}
+
+ done:
+	return ret;
+}
+
+long pcidtf_set_irq_event(pcidtf_dev_t * dev, unsigned long arg)
+{
+	PCIDTF_IRQ_EVENT data;
+	struct eventfd_ctx *trigger = NULL, *old;
+	pcidtf_irq_t *vec;
+	long ret = 0;
+
+	if (copy_from_user(&data, (int __user *)arg, sizeof(data))) {
+		ret = -EFAULT;
+		goto done;
+	}
+	if (data.fd >= 0) {
+		trigger = eventfd_ctx_fdget(data.fd);
+		if (IS_ERR(trigger)) {
+			ret = PTR_ERR(trigger);
+			goto done;
+		}
+	}
+
+	mutex_lock(&dev->irq_lock);
+	if (data.index < 0 || data.index >= dev->irq_count) {
+		mutex_unlock(&dev->irq_lock);
+		if (trigger)
+			eventfd_ctx_put(trigger);
+		ret = -EINVAL;
+		goto done;
+	}
+	vec = dev->irq + data.index;
+	old = vec->trigger;
+	WRITE_ONCE(vec->trigger, trigger);
+	if (old) {
+		/* Make sure the handler no longer uses the old context */
+		synchronize_irq(vec->irq);
+		eventfd_ctx_put(old);
+	}
+	mutex_unlock(&dev->irq_lock);
+
+ done:
+	return ret;
+}
+
+/*
+ * Wait until the interrupt count of a vector differs from the given count.
+ * The timeout is in milliseconds; a negative value waits forever and 0 only
+ * returns the current count and the CLOCK_MONOTONIC timestamp of the last
+ * interrupt.
+ */
+long pcidtf_wait_irq(pcidtf_dev_t * dev, unsigned long arg)
+{
+	PCIDTF_IRQ_WAIT data;
+	pcidtf_irq_t *vec;
+	bool valid;
+	long ret = 0;
+
+	if (copy_from_user(&data, (int __user *)arg, sizeof(data))) {
+		ret = -EFAULT;
+		goto done;
+	}
+	mutex_lock(&dev->irq_lock);
+	valid = data.index >= 0 && data.index < dev->irq_count;
+	mutex_unlock(&dev->irq_lock);
+	if (!valid) {
+		ret = -EINVAL;
+		goto done;
+	}
+	/*
+	 * The vector array is part of the device, so its counter stays valid
+	 * while the lock is dropped for waiting, which SET_IRQ must not block.
+	 */
+	vec = dev->irq + data.index;
+
+	if (data.timeout < 0) {
+		ret = wait_event_interruptible(dev->irq_wq,
+					       pcidtf_irq_changed(dev, vec,
+								  data.index,
+								  data.count));
+	} else if (data.timeout > 0) {
+		ret = wait_event_interruptible_timeout(dev->irq_wq,
+						       pcidtf_irq_changed(dev,
+									  vec,
+									  data.index,
+									  data.count),
+						       msecs_to_jiffies
+						       (data.timeout));
+		ret = ret > 0 ? 0 : (ret == 0 ? -ETIMEDOUT : ret);
+	}
+	mutex_lock(&dev->irq_lock);
+	if (ret == 0 && (data.index >= dev->irq_count || dev->dead))
+		ret = -ENODEV;
+	data.count = atomic64_read(&vec->count);
+	data.timestamp = vec->timestamp;
+	mutex_unlock(&dev->irq_lock);
+
+	if (copy_to_user((int __user *)arg, &data, sizeof(data))) {
+		ret = -EFAULT;
+		goto done;
+	}
+
+ done:
+	return ret;
+}
+
+/*
+ * Unmask INTx after the handler masked it. If the device still asserts the
+ * line, it stays masked and the pending interrupt is reported again.
+ */
+long pcidtf_unmask_irq(pcidtf_dev_t * dev, unsigned long arg)
+{
+	long ret = 0;
+
+	mutex_lock(&dev->irq_lock);
+	if (dev->irq_type != PCIDTF_IRQ_INTX)
+		ret = -EINVAL;
+	else if (!pci_check_and_unmask_intx(dev->pdev))
+		pcidtf_irq_signal(dev->irq);
+	mutex_unlock(&dev->irq_lock);
+	return ret;
+}
+
+unsigned int pcidtf_poll(struct file *filp, poll_table * wait)
+{
+	pcidtf_file_t *file = filp->private_data;
+	pcidtf_dev_t *dev = file->dev;
+
+	poll_wait(filp, &dev->irq_wq, wait);
+	if (READ_ONCE(dev->dead))
+		return POLLERR | POLLHUP;
+	if ((u64)atomic64_read(&dev->irq_events) != file->irq_seen)
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+/*
+ * Reading the device file returns the total number of interrupts of all
+ * vectors as a 64-bit value, blocking until it changes since the last read.
+ */
+ssize_t pcidtf_read(struct file *filp, char __user * buf, size_t count,
+		    loff_t * pos)
+{
+	pcidtf_file_t *file = filp->private_data;
+	pcidtf_dev_t *dev = file->dev;
+	u64 events;
+	ssize_t ret;
+
+	if (count < sizeof(events))
+		return -EINVAL;
+	down_read(&dev->remove_lock);
+	if (dev->dead) {
+		ret = -ENODEV;
+		goto out;
+	}
+	if (filp->f_flags & O_NONBLOCK) {
+		if ((u64)atomic64_read(&dev->irq_events) == file->irq_seen) {
+			ret = -EAGAIN;
+			goto out;
+		}
+	} else {
+		ret = wait_event_interruptible(dev->irq_wq,
+					       (u64)atomic64_read
+					       (&dev->irq_events) !=
+					       file->irq_seen ||
+					       READ_ONCE(dev->dead));
+		if (ret)
+			goto out;
+		if (dev->dead) {
+			ret = -ENODEV;
+			goto out;
+		}
+	}
+	events = atomic64_read(&dev->irq_events);
+	if (copy_to_user(buf, &events, sizeof(events))) {
+		ret = -EFAULT;
+		goto out;
+	}
+	file->irq_seen = events;
+	ret = sizeof(events);
+ out:
+	up_read(&dev->remove_lock);
+	return ret;
+}
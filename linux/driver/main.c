@@ -28,21 +28,54 @@
 #include <linux/fs.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
+#include <linux/mm.h>
+#include <linux/dma-mapping.h>
+#include <linux/slab.h>
+#include <linux/idr.h>
+#include <linux/mutex.h>
 #include <asm/uaccess.h>
 #include <linux/sched.h>
 #include <asm/current.h>
 #include "pcidtf.h"
+#include "pcidtf_ioctl.h"
 
 MODULE_LICENSE("Dual BSD/GPL");
 
-#define PCIDTF_MAX_DEVS	10
+/* Number of minor numbers reserved for devices */
+#define PCIDTF_MAX_DEVS	4096
 
 static int pcidtf_major = 0;
-static int pcidtf_minor = 0;
 static struct cdev pcidtf_cdev;
 static struct class *pcidtf_class = NULL;
 
-static struct pcidtf_dev *pcidtf_dev[PCIDTF_MAX_DEVS];
+/* Devices indexed by minor number */
+static DEFINE_IDR(pcidtf_minors);
+static DEFINE_MUTEX(pcidtf_minors_lock);
+
+/*
+ * Devices to bind in addition to the default ones, in the form of
+ * "vendor:device[:subvendor[:subdevice[:class[:class_mask]]]]" separated
+ * by commas. Devices can also be bound at run time through the new_id and
+ * driver_override attributes in sysfs.
+ */
+static char ids[1024];
+module_param_string(ids, ids, sizeof(ids), 0444);
+MODULE_PARM_DESC(ids, "Additional PCI IDs to bind "
+		 "(vendor:device[:subvendor[:subdevice[:class[:class_mask]]]])");
+
+static bool xhci = true;
+module_param(xhci, bool, 0444);
+MODULE_PARM_DESC(xhci, "Bind xHCI controllers (default: true)");
+
+/* Free the device when it is removed and its last file is closed */
+static void pcidtf_release_dev(struct kref *ref)
+{
+	pcidtf_dev_t *dev = container_of(ref, pcidtf_dev_t, ref);
+
+	pcidtf_exit_stats(dev);
+	idr_destroy(&dev->dma_idr);
+	kfree(dev);
+}
 
 static int pcidtf_open(struct inode *inode, struct file *file)
 {
@@ -51,7 +84,27 @@ static int pcidtf_open(struct inode *inode, struct file *file)
 	printk("%s - major %d, minor %d (pid %d)\n", __func__, imajor(inode),
 	       iminor(inode), current->pid);
 */
-	file->private_data = pcidtf_dev[iminor(inode)];
+	pcidtf_dev_t *dev;
+	pcidtf_file_t *priv;
+
+	mutex_lock(&pcidtf_minors_lock);
+	dev = idr_find(&pcidtf_minors, iminor(inode));
+	if (dev)
+		kref_get(&dev->ref);
+	mutex_unlock(&pcidtf_minors_lock);
+
+	if (dev == NULL)
+		return -ENODEV;
+	priv = kzalloc(sizeof(pcidtf_file_t), GFP_KERNEL);
+	if (priv == NULL) {
+		kref_put(&dev->ref, pcidtf_release_dev);
+		return -ENOMEM;
+	}
+	priv->dev = dev;
+	priv->irq_seen = atomic64_read(&dev->irq_events);
+	pcidtf_init_ucache(priv);
+	pcidtf_init_prog(priv);
+	file->private_data = priv;
 	return 0;
 }
 
@@ -62,13 +115,117 @@ static int pcidtf_close(struct inode *inode, struct file *file)
 	printk("%s - major %d, minor %d (pid %d)\n", __func__, imajor(inode),
 	       iminor(inode), current->pid);
 */
+	pcidtf_file_t *priv = file->private_data;
+	pcidtf_dev_t *dev = priv->dev;
+
+	pcidtf_flush_ucache(priv);
+	pcidtf_free_all_progs(priv);
+	kfree(priv);
+	kref_put(&dev->ref, pcidtf_release_dev);
 	return 0;
 }
 
+static void pcidtf_vma_open(struct vm_area_struct *vma)
+{
+	pcidtf_dma_t *dma = vma->vm_private_data;
+
+	kref_get(&dma->ref);
+}
+
+static void pcidtf_vma_close(struct vm_area_struct *vma)
+{
+	pcidtf_put_dma(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct pcidtf_dma_vm_ops = {
+	.open = pcidtf_vma_open,
+	.close = pcidtf_vma_close,
+};
+
+static int pcidtf_mmap_dma(pcidtf_dev_t * dev, struct vm_area_struct *vma)
+{
+	pcidtf_dma_t *dma;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	int ret;
+
+	dma = pcidtf_get_dma(dev, vma->vm_pgoff - PCIDTF_MMAP_DMA_BASE);
+	if (dma == NULL)
+		return -EINVAL;
+	if (dma->type == PCIDTF_DMA_USER || size > PAGE_ALIGN(dma->len)) {
+		pcidtf_put_dma(dma);
+		return -EINVAL;
+	}
+
+	/* The page offset selects the buffer, so map from its beginning */
+	vma->vm_pgoff = 0;
+	if (dma->type == PCIDTF_DMA_STREAM) {
+		/* Streaming buffers are normal pages and stay cacheable */
+		ret = remap_pfn_range(vma, vma->vm_start,
+				      virt_to_phys(dma->vaddr) >> PAGE_SHIFT,
+				      size, vma->vm_page_prot);
+	} else {
+		ret = dma_mmap_coherent(&dev->pdev->dev, vma, dma->vaddr,
+					dma->paddr, size);
+	}
+	if (ret) {
+		pcidtf_put_dma(dma);
+		return ret;
+	}
+
+	/* The mapping keeps a reference until it is unmapped */
+	vma->vm_private_data = dma;
+	vma->vm_ops = &pcidtf_dma_vm_ops;
+	return 0;
+}
+
+static int pcidtf_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	pcidtf_file_t *priv = file->private_data;
+	pcidtf_dev_t *dev = priv->dev;
+	pcidtf_iomap_t *iomap;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long bar = vma->vm_pgoff;
+	int ret;
+
+	down_read(&dev->remove_lock);
+	if (dev->dead) {
+		ret = -ENODEV;
+		goto out;
+	}
+	if (vma->vm_pgoff >= PCIDTF_MMAP_DMA_BASE) {
+		ret = pcidtf_mmap_dma(dev, vma);
+		goto out;
+	}
+	ret = -EINVAL;
+	if (bar >= dev->iomap_count)
+		goto out;
+	iomap = dev->iomap + bar;
+
+	/* Only page-aligned memory BARs can be mapped into user space */
+	if (!(iomap->flags & IORESOURCE_MEM))
+		goto out;
+	if ((iomap->start & ~PAGE_MASK) || size > PAGE_ALIGN(iomap->len))
+		goto out;
+
+	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+	ret = io_remap_pfn_range(vma, vma->vm_start,
+				 iomap->start >> PAGE_SHIFT, size,
+				 vma->vm_page_prot);
+ out:
+	up_read(&dev->remove_lock);
+	return ret;
+}
+
 static struct file_operations pcidtf_fops = {
 	.open = pcidtf_open,
 	.release = pcidtf_close,
 	.unlocked_ioctl = pcidtf_ioctl,
+	.mmap = pcidtf_mmap,
+	.poll = pcidtf_poll,
+	.read = pcidtf_read,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+	.uring_cmd = pcidtf_uring_cmd,
+#endif
 };
 
 static struct pci_device_id pcidtf_id_table[] = {
@@ -84,7 +241,9 @@ static void pcidtf_init_iomap(struct pci_dev *pdev, struct pcidtf_dev *dev)
 	for (bar = 0, iomap = dev->iomap; bar < 6; bar++) {
 		iomap->addr = pci_iomap(pdev, bar, 0);
 		if (iomap->addr) {
+			iomap->bar = bar;
 			iomap->start = pci_resource_start(pdev, bar);
+			iomap->flags = pci_resource_flags(pdev, bar);
 			iomap->len = pci_resource_len(pdev, bar);
 			printk
 			    ("I/O space mapped (bar %u, addr 0x%p, start 0x%lX, len 0x%X)\n",
@@ -98,14 +257,27 @@ static void pcidtf_init_iomap(struct pci_dev *pdev, struct pcidtf_dev *dev)
 
 static int pcidtf_init_dev(struct pcidtf_dev *data)
 {
+	int minor;
+
+	/* Reserve a minor number, and publish the device once it is ready */
+	mutex_lock(&pcidtf_minors_lock);
+	minor = idr_alloc(&pcidtf_minors, NULL, 0, PCIDTF_MAX_DEVS, GFP_KERNEL);
+	mutex_unlock(&pcidtf_minors_lock);
+	if (minor < 0)
+		return minor;
+
 	data->cdev =
-	    device_create(pcidtf_class, NULL, MKDEV(pcidtf_major, pcidtf_minor),
-			  NULL, "pcidtf%d", pcidtf_minor);
-	if (data->cdev == NULL) {
-		return -1;
+	    device_create_with_groups(pcidtf_class, &data->pdev->dev,
+				      MKDEV(pcidtf_major, minor), data,
+				      pcidtf_stats_groups, "pcidtf%d", minor);
+	if (IS_ERR(data->cdev)) {
+		mutex_lock(&pcidtf_minors_lock);
+		idr_remove(&pcidtf_minors, minor);
+		mutex_unlock(&pcidtf_minors_lock);
+		return PTR_ERR(data->cdev);
 	}
 
-	data->minor = pcidtf_minor++;
+	data->minor = minor;
 
 	return 0;
 }
@@ -113,7 +285,7 @@ static int pcidtf_init_dev(struct pcidtf_dev *data)
 static int pcidtf_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 {
 	struct pcidtf_dev *dev;
-	int ret;
+	int i, ret;
 
 	printk("Device initialized - ven %04X, dev %04X\n",
 	       pdev->vendor, pdev->device);
@@ -124,13 +296,17 @@ static int pcidtf_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 
 	memset(dev, 0, sizeof(struct pcidtf_dev));
 
-	dev->dma_count = 8;
-	dev->dma = kmalloc(sizeof(pcidtf_dma_t) * dev->dma_count, GFP_KERNEL);
-	if (dev->dma == NULL) {
-		ret = -ENOMEM;
-		goto error;
+	kref_init(&dev->ref);
+	init_rwsem(&dev->remove_lock);
+	idr_init(&dev->dma_idr);
+	spin_lock_init(&dev->dma_lock);
+	pcidtf_init_irq(dev);
+
+	dev->pool = pcidtf_create_pool(pdev);
+	if (dev->pool == NULL) {
+		kfree(dev);
+		return -ENOMEM;
 	}
-	memset(dev->dma, 0, sizeof(pcidtf_dma_t) * dev->dma_count);
 
 	ret = pci_enable_device(pdev);
 	if (ret)
@@ -143,17 +319,31 @@ static int pcidtf_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 	dev->pdev = pdev;
 	pcidtf_init_iomap(pdev, dev);
 
-	pcidtf_init_dev(dev);
+	ret = pcidtf_init_stats(dev);
+	if (ret)
+		goto error_stats;
+
+	ret = pcidtf_init_dev(dev);
+	if (ret)
+		goto error_dev;
 
 	pci_set_drvdata(pdev, dev);
 
-	pcidtf_dev[dev->minor] = dev;
+	mutex_lock(&pcidtf_minors_lock);
+	idr_replace(&pcidtf_minors, dev, dev->minor);
+	mutex_unlock(&pcidtf_minors_lock);
 
 	return 0;
 
+ error_dev:
+	pcidtf_exit_stats(dev);
+ error_stats:
+	for (i = 0; i < dev->iomap_count; i++)
+		pci_iounmap(pdev, dev->iomap[i].addr);
+	pci_disable_device(pdev);
  error:
-	if (dev->dma)
-		kfree(dev->dma);
+	pcidtf_destroy_pool(dev->pool);
+	idr_destroy(&dev->dma_idr);
 	kfree(dev);
 	return ret;
 }
@@ -167,8 +357,24 @@ static void pcidtf_remove(struct pci_dev *pdev)
 
 	printk("Device removed\n");
 
+	mutex_lock(&pcidtf_minors_lock);
+	idr_remove(&pcidtf_minors, dev->minor);
+	mutex_unlock(&pcidtf_minors_lock);
+
 	device_destroy(pcidtf_class, MKDEV(pcidtf_major, dev->minor));
 
+	/*
+	 * Files may still be open. Fail their operations from now on, wake
+	 * their waiters and wait for the running operations to return before
+	 * the hardware resources are released.
+	 */
+	WRITE_ONCE(dev->dead, true);
+	wake_up_all(&dev->irq_wq);
+	down_write(&dev->remove_lock);
+	up_write(&dev->remove_lock);
+
+	pcidtf_disable_irq(dev);
+
 	for (i = 0, iomap = dev->iomap; i < dev->iomap_count; i++, iomap++) {
 		if (iomap->addr) {
 			printk
@@ -178,22 +384,13 @@ static void pcidtf_remove(struct pci_dev *pdev)
 		}
 	}
 
-	if ((dma = dev->dma) != NULL) {
-		for (i = 0; i < dev->dma_count; i++, dma++) {
-			if (dma->vaddr) {
-				printk
-				    ("Free DMA buffer (idx %d, len %u, vaddr 0x%p, paddr 0x%llX)\n",
-				     i, dma->len, dma->vaddr, dma->paddr);
-				pci_free_consistent(pdev, dma->len, dma->vaddr,
-						    dma->paddr);
-			}
-		}
-		kfree(dev->dma);
-	}
+	idr_for_each_entry(&dev->dma_idr, dma, i)
+		pcidtf_remove_dma(dev, i, NULL);
+	pcidtf_destroy_pool(dev->pool);
 
 	pci_disable_device(pdev);
 
-	kfree(dev);
+	kref_put(&dev->ref, pcidtf_release_dev);
 }
 
 static struct pci_driver pcidtf_driver = {
@@ -203,6 +400,32 @@ static struct pci_driver pcidtf_driver = {
 	.remove = pcidtf_remove
 };
 
+/* Add the devices given by the "ids" parameter as dynamic IDs */
+static void pcidtf_add_ids(void)
+{
+	char *p = ids, *id;
+	unsigned int vendor, device, subvendor, subdevice, class, class_mask;
+	int fields;
+
+	while ((id = strsep(&p, ",")) != NULL) {
+		if (*id == '\0')
+			continue;
+		subvendor = subdevice = PCI_ANY_ID;
+		class = class_mask = 0;
+		fields = sscanf(id, "%x:%x:%x:%x:%x:%x", &vendor, &device,
+				&subvendor, &subdevice, &class, &class_mask);
+		if (fields < 2) {
+			printk("Invalid ID - %s\n", id);
+			continue;
+		}
+		if (pci_add_dynid(&pcidtf_driver, vendor, device, subvendor,
+				  subdevice, class, class_mask, 0))
+			printk("Failed to add ID - %s\n", id);
+		else
+			printk("ID added - %04X:%04X\n", vendor, device);
+	}
+}
+
 static int pcidtf_init(void)
 {
 	dev_t dev = MKDEV(0, 0);
@@ -227,21 +450,32 @@ static int pcidtf_init(void)
 		goto error;
 	}
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+	pcidtf_class = class_create("pcidtf");
+#else
 	pcidtf_class = class_create(THIS_MODULE, "pcidtf");
+#endif
 	if (IS_ERR(pcidtf_class)) {
 		printk("class_create failed\n");
 		goto error;
 	}
 
+	pcidtf_init_debugfs();
+
+	if (!xhci)
+		pcidtf_driver.id_table = NULL;
 	ret = pci_register_driver(&pcidtf_driver);
 	if (ret) {
 		printk("pci_register_driver failed\n");
 		goto error;
 	}
+	pcidtf_add_ids();
 
 	return 0;
 
  error:
+	pcidtf_exit_debugfs();
+
 	if (!IS_ERR(pcidtf_class))
 		class_destroy(pcidtf_class);
 
@@ -258,12 +492,16 @@ static void pcidtf_exit(void)
 {
 	pci_unregister_driver(&pcidtf_driver);
 
+	pcidtf_exit_debugfs();
+
 	class_destroy(pcidtf_class);
 
 	cdev_del(&pcidtf_cdev);
 
 	unregister_chrdev_region(MKDEV(pcidtf_major, 0), PCIDTF_MAX_DEVS);
 
+	idr_destroy(&pcidtf_minors);
+
 	printk("Driver unloaded\n");
 }
 
@@ -24,29 +24,241 @@
 #ifndef _PCIDTF_H
 #define _PCIDTF_H
 
+#include <linux/version.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/scatterlist.h>
+#include <linux/list.h>
+#include <linux/mmu_notifier.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include "pcidtf_ioctl.h"
+
+/* access_ok() lost its type argument in Linux 5.0 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+#define pcidtf_access_ok(type, addr, size)	access_ok(addr, size)
+#else
+#define pcidtf_access_ok(type, addr, size)	access_ok(type, addr, size)
+#endif
+
 typedef struct pcidtf_iomap {
+	int bar;
 	void __iomem *addr;
 	unsigned long start;
+	unsigned long flags;
 	int len;
 } pcidtf_iomap_t;
 
+/*
+ * Coherent DMA buffers are recycled through power-of-two size classes from
+ * a page to 4 MiB. Smaller buffers take a whole page so that every buffer
+ * can be mapped to user space without exposing its neighbours.
+ */
+#define PCIDTF_POOL_MIN_SHIFT	PAGE_SHIFT
+#define PCIDTF_POOL_MAX_SHIFT	22
+#define PCIDTF_POOL_CLASSES	(PCIDTF_POOL_MAX_SHIFT - PCIDTF_POOL_MIN_SHIFT + 1)
+#define PCIDTF_POOL_MAX_FREE	64	/* cached buffers per class */
+
+typedef struct pcidtf_pool_class {
+	struct list_head clean;
+	struct list_head dirty;
+	int count;
+} pcidtf_pool_class_t;
+
+typedef struct pcidtf_pool {
+	struct kref ref;
+	struct pci_dev *pdev;
+	spinlock_t lock;
+	struct work_struct work;
+	bool dead;
+	pcidtf_pool_class_t cls[PCIDTF_POOL_CLASSES];
+	PCIDTF_POOL_STATS stats;
+} pcidtf_pool_t;
+
+/* Register access latency histogram, indexed by BAR, width and direction */
+#define PCIDTF_LAT_WIDTHS	4	/* 1, 2, 4 and 8 bytes */
+
+typedef struct pcidtf_lat {
+	atomic64_t count;
+	atomic64_t sum;
+	atomic64_t min;
+	atomic64_t max;
+	atomic64_t buckets[PCIDTF_LAT_BUCKETS];
+} pcidtf_lat_t;
+
+/* DMA buffer types */
+#define PCIDTF_DMA_COHERENT	0
+#define PCIDTF_DMA_USER		1
+#define PCIDTF_DMA_STREAM	2
+
 typedef struct pcidtf_dma {
+	struct kref ref;
+	struct rcu_head rcu;
+	struct pci_dev *pdev;
+	int id;
+	int type;
+	pcidtf_pool_t *pool;
 	void *vaddr;
 	dma_addr_t paddr;
 	int len;
+	struct page **pages;
+	int npages;
+	struct sg_table sgt;
+	int nents;
+	/* Registration cache state of user buffers */
+	struct pcidtf_file *owner;
+	struct list_head link;
+	unsigned long start;
+	bool idle;
+	bool stale;
 } pcidtf_dma_t;
 
+typedef struct pcidtf_irq {
+	struct pcidtf_dev *dev;
+	unsigned int irq;
+	struct eventfd_ctx *trigger;
+	atomic64_t count;
+	u64 timestamp;
+} pcidtf_irq_t;
+
 typedef struct pcidtf_dev {
+	/* Open files keep the device until they are closed */
+	struct kref ref;
+	/* Held for reading by file operations, set dead when removed */
+	struct rw_semaphore remove_lock;
+	bool dead;
 	struct pci_dev *pdev;
 	struct device *cdev;
 	pcidtf_iomap_t iomap[6];
 	int iomap_count;
 	int minor;
-	pcidtf_dma_t *dma;
-	int dma_count;
+	pcidtf_pool_t *pool;
+	struct idr dma_idr;
+	spinlock_t dma_lock;
+	struct mutex irq_lock;
+	wait_queue_head_t irq_wq;
+	atomic64_t irq_events;
+	int irq_type;
+	int irq_count;
+	pcidtf_irq_t irq[PCIDTF_MAX_IRQS];
+	struct msix_entry msix[PCIDTF_MAX_IRQS];
+	pcidtf_lat_t reg_lat[6][PCIDTF_LAT_WIDTHS][2];
+	struct dentry *debugfs;
+	PCIDTF_DEV_STATS __percpu *stats;
 } pcidtf_dev_t;
 
+/* Maximum number of idle registrations kept pinned per file */
+#define PCIDTF_UCACHE_MAX	16
+
+typedef struct pcidtf_file {
+	pcidtf_dev_t *dev;
+	u64 irq_seen;
+#ifdef CONFIG_MMU_NOTIFIER
+	struct mmu_notifier mn;
+#endif
+	struct mm_struct *mm;
+	struct mutex ucache_mutex;
+	spinlock_t ucache_lock;
+	struct list_head ucache;
+	int ucache_idle;
+	struct idr prog_idr;
+	struct mutex prog_lock;
+} pcidtf_file_t;
+
 extern long pcidtf_ioctl(struct file *filp, unsigned int cmd,
 			 unsigned long arg);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+struct io_uring_cmd;
+extern int pcidtf_uring_cmd(struct io_uring_cmd *ioucmd,
+			    unsigned int issue_flags);
+#endif
+extern int pcidtf_cfg_rw(pcidtf_dev_t * dev, int read, int off, int len,
+			 u32 * val);
+extern int pcidtf_reg_rw(pcidtf_dev_t * dev, int read, int bar, int off,
+			 int len, u64 * val);
+extern pcidtf_dma_t *pcidtf_new_dma(pcidtf_dev_t * dev, int type, int len);
+extern int pcidtf_add_dma(pcidtf_dev_t * dev, pcidtf_dma_t * dma);
+extern pcidtf_dma_t *pcidtf_get_dma(pcidtf_dev_t * dev, int id);
+extern void pcidtf_put_dma(pcidtf_dma_t * dma);
+extern int pcidtf_remove_dma(pcidtf_dev_t * dev, int id,
+			     pcidtf_file_t * file);
+
+extern long pcidtf_map_user(pcidtf_file_t * file, unsigned long arg);
+extern void pcidtf_release_user_dma(pcidtf_dma_t * dma);
+extern int pcidtf_copy_user_dma(pcidtf_dma_t * dma, int read, int off,
+				void __user * buf, int len);
+extern void pcidtf_init_ucache(pcidtf_file_t * file);
+extern void pcidtf_put_ucache(pcidtf_file_t * file, pcidtf_dma_t * dma);
+extern void pcidtf_flush_ucache(pcidtf_file_t * file);
+
+extern bool pcidtf_lat_enabled;
+
+static inline s64 pcidtf_lat_start(void)
+{
+	return pcidtf_lat_enabled ? ktime_to_ns(ktime_get()) : 0;
+}
+
+/* Return the histogram bucket of a latency: bucket n holds [2^n, 2^(n+1)) */
+static inline int pcidtf_lat_bucket(s64 ns)
+{
+	int n = ns > 0 ? fls64(ns) - 1 : 0;
+
+	return min(n, PCIDTF_LAT_BUCKETS - 1);
+}
+
+extern void pcidtf_lat_end(pcidtf_dev_t * dev, int read, int bar, int len,
+			   s64 start);
+extern void pcidtf_init_debugfs(void);
+extern void pcidtf_exit_debugfs(void);
+extern int pcidtf_init_stats(pcidtf_dev_t * dev);
+extern void pcidtf_exit_stats(pcidtf_dev_t * dev);
+extern const struct attribute_group *pcidtf_stats_groups[];
+
+/* Account the data moved by a successful ioctl */
+static inline void pcidtf_count_bytes(pcidtf_dev_t * dev, unsigned int cmd,
+				      u64 len)
+{
+	if (_IOC_NR(cmd) < PCIDTF_STATS_OPS)
+		this_cpu_add(dev->stats->ops[_IOC_NR(cmd)].bytes, len);
+}
+
+extern void pcidtf_count_op(pcidtf_dev_t * dev, unsigned int cmd, long ret,
+			    s64 start);
+extern long pcidtf_get_stats(pcidtf_dev_t * dev, unsigned long arg);
+
+extern long pcidtf_run_bench(pcidtf_dev_t * dev, unsigned long arg);
+extern long pcidtf_get_reg_stats(pcidtf_dev_t * dev, unsigned long arg);
+extern long pcidtf_reset_reg_stats(pcidtf_dev_t * dev, unsigned long arg);
+
+extern void pcidtf_init_prog(pcidtf_file_t * file);
+extern void pcidtf_free_all_progs(pcidtf_file_t * file);
+extern long pcidtf_load_prog(pcidtf_file_t * file, unsigned long arg);
+extern long pcidtf_run_prog(pcidtf_file_t * file, unsigned long arg);
+extern long pcidtf_free_prog(pcidtf_file_t * file, unsigned long arg);
+
+extern pcidtf_pool_t *pcidtf_create_pool(struct pci_dev *pdev);
+extern void pcidtf_destroy_pool(pcidtf_pool_t * pool);
+extern void *pcidtf_pool_alloc(pcidtf_pool_t * pool, int len,
+			       dma_addr_t * paddr);
+extern void pcidtf_pool_free(pcidtf_pool_t * pool, int len, void *vaddr,
+			     dma_addr_t paddr);
+extern long pcidtf_get_pool_stats(pcidtf_dev_t * dev, unsigned long arg);
+
+extern void pcidtf_init_irq(pcidtf_dev_t * dev);
+extern void pcidtf_disable_irq(pcidtf_dev_t * dev);
+extern long pcidtf_set_irq(pcidtf_dev_t * dev, unsigned long arg);
+extern long pcidtf_set_irq_event(pcidtf_dev_t * dev, unsigned long arg);
+extern long pcidtf_wait_irq(pcidtf_dev_t * dev, unsigned long arg);
+extern long pcidtf_unmask_irq(pcidtf_dev_t * dev, unsigned long arg);
+extern unsigned int pcidtf_poll(struct file *filp, poll_table * wait);
+extern ssize_t pcidtf_read(struct file *filp, char __user * buf,
+			   size_t count, loff_t * pos);
 
 #endif
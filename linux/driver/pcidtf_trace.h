@@ -0,0 +1,114 @@
+/*
+ * PCI Device Test Framework
+ * Linux kernel-mode driver.
+ * This file defines trace events of configuration space, I/O register
+ * and DMA buffer accesses.
+ *
+ * Copyright (C) 2013 Hiromitsu Sakamoto
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM pcidtf
+
+#if !defined(_PCIDTF_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _PCIDTF_TRACE_H
+
+#include <linux/pci.h>
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(cfg_access,
+	    TP_PROTO(struct pci_dev *pdev, int read, int off, int len,
+		     u32 val, int ret),
+	    TP_ARGS(pdev, read, off, len, val, ret),
+	    TP_STRUCT__entry(__field(u8, bus)
+			     __field(u8, devfn)
+			     __field(int, read)
+			     __field(int, off)
+			     __field(int, len)
+			     __field(u32, val)
+			     __field(int, ret)),
+	    TP_fast_assign(__entry->bus = pdev->bus->number;
+			   __entry->devfn = pdev->devfn;
+			   __entry->read = read;
+			   __entry->off = off;
+			   __entry->len = len;
+			   __entry->val = val;
+			   __entry->ret = ret;),
+	    TP_printk("%02x:%02x.%d %s off=0x%x len=%d val=0x%x ret=%d",
+		      __entry->bus, PCI_SLOT(__entry->devfn),
+		      PCI_FUNC(__entry->devfn),
+		      __entry->read ? "read" : "write", __entry->off,
+		      __entry->len, __entry->val, __entry->ret)
+);
+
+TRACE_EVENT(reg_access,
+	    TP_PROTO(struct pci_dev *pdev, int read, int bar, int off, int len,
+		     u64 val),
+	    TP_ARGS(pdev, read, bar, off, len, val),
+	    TP_STRUCT__entry(__field(u8, bus)
+			     __field(u8, devfn)
+			     __field(int, read)
+			     __field(int, bar)
+			     __field(int, off)
+			     __field(int, len)
+			     __field(u64, val)),
+	    TP_fast_assign(__entry->bus = pdev->bus->number;
+			   __entry->devfn = pdev->devfn;
+			   __entry->read = read;
+			   __entry->bar = bar;
+			   __entry->off = off;
+			   __entry->len = len;
+			   __entry->val = val;),
+	    TP_printk("%02x:%02x.%d %s bar=%d off=0x%x len=%d val=0x%llx",
+		      __entry->bus, PCI_SLOT(__entry->devfn),
+		      PCI_FUNC(__entry->devfn),
+		      __entry->read ? "read" : "write", __entry->bar,
+		      __entry->off, __entry->len,
+		      (unsigned long long)__entry->val)
+);
+
+TRACE_EVENT(dma_copy,
+	    TP_PROTO(struct pci_dev *pdev, int read, int id, int off, int len),
+	    TP_ARGS(pdev, read, id, off, len),
+	    TP_STRUCT__entry(__field(u8, bus)
+			     __field(u8, devfn)
+			     __field(int, read)
+			     __field(int, id)
+			     __field(int, off)
+			     __field(int, len)),
+	    TP_fast_assign(__entry->bus = pdev->bus->number;
+			   __entry->devfn = pdev->devfn;
+			   __entry->read = read;
+			   __entry->id = id;
+			   __entry->off = off;
+			   __entry->len = len;),
+	    TP_printk("%02x:%02x.%d %s id=%d off=0x%x len=%d",
+		      __entry->bus, PCI_SLOT(__entry->devfn),
+		      PCI_FUNC(__entry->devfn),
+		      __entry->read ? "read" : "write", __entry->id,
+		      __entry->off, __entry->len)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE pcidtf_trace
+
+#include <trace/define_trace.h>
@@ -0,0 +1,295 @@
+/*
+ * PCI Device Test Framework
+ * This file implements the recycling pool of coherent DMA buffers.
+ *
+ * Copyright (C) 2013 Hiromitsu Sakamoto
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ */
+
+#include <linux/pci.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/sched.h>
+#include <linux/dma-mapping.h>
+#include <asm/uaccess.h>
+
+#include "pcidtf.h"
+#include "pcidtf_ioctl.h"
+
+/* A cached buffer in a size class */
+typedef struct pcidtf_pool_buf {
+	struct list_head link;
+	void *vaddr;
+	dma_addr_t paddr;
+} pcidtf_pool_buf_t;
+
+/* Return the size class of a buffer, or -1 if it is too large to cache */
+static int pcidtf_pool_class(int len)
+{
+	int shift = max_t(int, order_base_2(len), PCIDTF_POOL_MIN_SHIFT);
+
+	return shift > PCIDTF_POOL_MAX_SHIFT ? -1 :
+	    shift - PCIDTF_POOL_MIN_SHIFT;
+}
+
+static inline size_t pcidtf_pool_size(int i)
+{
+	return (size_t)1 << (i + PCIDTF_POOL_MIN_SHIFT);
+}
+
+static void *pcidtf_pool_alloc_buf(pcidtf_pool_t * pool, int i,
+				   dma_addr_t * paddr)
+{
+	return dma_alloc_coherent(&pool->pdev->dev, pcidtf_pool_size(i), paddr,
+				  GFP_KERNEL);
+}
+
+static void pcidtf_pool_free_buf(pcidtf_pool_t * pool, int i, void *vaddr,
+				 dma_addr_t paddr)
+{
+	dma_free_coherent(&pool->pdev->dev, pcidtf_pool_size(i), vaddr, paddr);
+}
+
+/* Return all cached buffers to the DMA API */
+static void pcidtf_pool_drain(pcidtf_pool_t * pool)
+{
+	pcidtf_pool_class_t *c;
+	pcidtf_pool_buf_t *buf, *tmp;
+	LIST_HEAD(list);
+	int i;
+
+	for (i = 0, c = pool->cls; i < PCIDTF_POOL_CLASSES; i++, c++) {
+		spin_lock(&pool->lock);
+		list_splice_init(&c->clean, &list);
+		list_splice_init(&c->dirty, &list);
+		pool->stats.cached -= pcidtf_pool_size(i) * c->count;
+		c->count = 0;
+		spin_unlock(&pool->lock);
+
+		list_for_each_entry_safe(buf, tmp, &list, link) {
+			list_del(&buf->link);
+			pcidtf_pool_free_buf(pool, i, buf->vaddr, buf->paddr);
+			kfree(buf);
+		}
+	}
+}
+
+/*
+ * Zero freed buffers in the background so that allocation need not. A
+ * buffer being zeroed is on neither list and not counted as cached, so
+ * that draining the pool meanwhile leaves it to this function, which
+ * releases it if the pool died or the class filled up in the meantime.
+ */
+static void pcidtf_pool_work(struct work_struct *work)
+{
+	pcidtf_pool_t *pool = container_of(work, pcidtf_pool_t, work);
+	pcidtf_pool_class_t *c;
+	pcidtf_pool_buf_t *buf;
+	int i;
+
+	for (i = 0, c = pool->cls; i < PCIDTF_POOL_CLASSES; i++, c++) {
+		spin_lock(&pool->lock);
+		while (!pool->dead && !list_empty(&c->dirty)) {
+			buf = list_first_entry(&c->dirty, pcidtf_pool_buf_t,
+					       link);
+			list_del(&buf->link);
+			c->count--;
+			pool->stats.cached -= pcidtf_pool_size(i);
+			spin_unlock(&pool->lock);
+
+			memset(buf->vaddr, 0, pcidtf_pool_size(i));
+			cond_resched();
+
+			spin_lock(&pool->lock);
+			if (pool->dead || c->count >= PCIDTF_POOL_MAX_FREE) {
+				spin_unlock(&pool->lock);
+				pcidtf_pool_free_buf(pool, i, buf->vaddr,
+						     buf->paddr);
+				kfree(buf);
+				spin_lock(&pool->lock);
+				continue;
+			}
+			list_add(&buf->link, &c->clean);
+			c->count++;
+			pool->stats.cached += pcidtf_pool_size(i);
+		}
+		spin_unlock(&pool->lock);
+	}
+}
+
+pcidtf_pool_t *pcidtf_create_pool(struct pci_dev *pdev)
+{
+	pcidtf_pool_t *pool;
+	pcidtf_pool_class_t *c;
+	int i;
+
+	pool = kzalloc(sizeof(pcidtf_pool_t), GFP_KERNEL);
+	if (pool == NULL)
+		return NULL;
+	kref_init(&pool->ref);
+	pool->pdev = pci_dev_get(pdev);
+	spin_lock_init(&pool->lock);
+	INIT_WORK(&pool->work, pcidtf_pool_work);
+
+	for (i = 0, c = pool->cls; i < PCIDTF_POOL_CLASSES; i++, c++) {
+		INIT_LIST_HEAD(&c->clean);
+		INIT_LIST_HEAD(&c->dirty);
+	}
+	return pool;
+}
+
+static void pcidtf_release_pool(struct kref *ref)
+{
+	pcidtf_pool_t *pool = container_of(ref, pcidtf_pool_t, ref);
+
+	cancel_work_sync(&pool->work);
+	pcidtf_pool_drain(pool);
+	pci_dev_put(pool->pdev);
+	kfree(pool);
+}
+
+/*
+ * Stop caching and release the cached buffers when the device is removed.
+ * The pool itself is freed when the last buffer allocated from it is freed.
+ */
+void pcidtf_destroy_pool(pcidtf_pool_t * pool)
+{
+	spin_lock(&pool->lock);
+	pool->dead = true;
+	spin_unlock(&pool->lock);
+	pcidtf_pool_drain(pool);
+	kref_put(&pool->ref, pcidtf_release_pool);
+}
+
+/*
+ * Allocate a zeroed coherent DMA buffer. A cached buffer of the same size
+ * class is reused if any, and the DMA API is called otherwise.
+ */
+void *pcidtf_pool_alloc(pcidtf_pool_t * pool, int len, dma_addr_t * paddr)
+{
+	pcidtf_pool_class_t *c;
+	pcidtf_pool_buf_t *buf = NULL;
+	bool dirty = false;
+	void *vaddr;
+	int i;
+
+	i = pcidtf_pool_class(len);
+	if (i < 0) {
+		spin_lock(&pool->lock);
+		pool->stats.misses++;
+		spin_unlock(&pool->lock);
+		vaddr = dma_alloc_coherent(&pool->pdev->dev, len, paddr,
+					   GFP_KERNEL);
+		if (vaddr == NULL)
+			return NULL;
+		memset(vaddr, 0, len);
+		kref_get(&pool->ref);
+		return vaddr;
+	}
+
+	c = &pool->cls[i];
+	spin_lock(&pool->lock);
+	if (!list_empty(&c->clean)) {
+		buf = list_first_entry(&c->clean, pcidtf_pool_buf_t, link);
+	} else if (!list_empty(&c->dirty)) {
+		buf = list_first_entry(&c->dirty, pcidtf_pool_buf_t, link);
+		dirty = true;
+	}
+	if (buf) {
+		list_del(&buf->link);
+		c->count--;
+		pool->stats.cached -= pcidtf_pool_size(i);
+		pool->stats.hits++;
+	} else {
+		pool->stats.misses++;
+	}
+	spin_unlock(&pool->lock);
+
+	if (buf) {
+		vaddr = buf->vaddr;
+		*paddr = buf->paddr;
+		kfree(buf);
+		if (dirty)
+			memset(vaddr, 0, pcidtf_pool_size(i));
+	} else {
+		vaddr = pcidtf_pool_alloc_buf(pool, i, paddr);
+		if (vaddr == NULL)
+			return NULL;
+		memset(vaddr, 0, pcidtf_pool_size(i));
+	}
+	kref_get(&pool->ref);
+	return vaddr;
+}
+
+/* Free a buffer allocated by pcidtf_pool_alloc() */
+void pcidtf_pool_free(pcidtf_pool_t * pool, int len, void *vaddr,
+		      dma_addr_t paddr)
+{
+	pcidtf_pool_class_t *c;
+	pcidtf_pool_buf_t *buf;
+	int i;
+
+	i = pcidtf_pool_class(len);
+	if (i < 0) {
+		spin_lock(&pool->lock);
+		pool->stats.released++;
+		spin_unlock(&pool->lock);
+		dma_free_coherent(&pool->pdev->dev, len, vaddr, paddr);
+		goto done;
+	}
+
+	c = &pool->cls[i];
+	buf = kmalloc(sizeof(pcidtf_pool_buf_t), GFP_KERNEL);
+	spin_lock(&pool->lock);
+	if (buf && !pool->dead && c->count < PCIDTF_POOL_MAX_FREE) {
+		buf->vaddr = vaddr;
+		buf->paddr = paddr;
+		list_add_tail(&buf->link, &c->dirty);
+		c->count++;
+		pool->stats.cached += pcidtf_pool_size(i);
+		pool->stats.recycled++;
+		buf = NULL;
+		vaddr = NULL;
+	} else {
+		pool->stats.released++;
+	}
+	spin_unlock(&pool->lock);
+
+	if (vaddr) {
+		kfree(buf);
+		pcidtf_pool_free_buf(pool, i, vaddr, paddr);
+	} else {
+		schedule_work(&pool->work);
+	}
+ done:
+	kref_put(&pool->ref, pcidtf_release_pool);
+}
+
+long pcidtf_get_pool_stats(pcidtf_dev_t * dev, unsigned long arg)
+{
+	PCIDTF_POOL_STATS data;
+	long ret = 0;
+
+	spin_lock(&dev->pool->lock);
+	data = dev->pool->stats;
+	spin_unlock(&dev->pool->lock);
+
+	if (copy_to_user((int __user *)arg, &data, sizeof(data)))
+		ret = -EFAULT;
+	return ret;
+}
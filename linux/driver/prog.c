@@ -0,0 +1,422 @@
+/*
+ * PCI Device Test Framework
+ * This file implements the register microprogram engine.
+ *
+ * Copyright (C) 2013 Hiromitsu Sakamoto
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ */
+
+#include <linux/pci.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <asm/uaccess.h>
+
+#include "pcidtf.h"
+#include "pcidtf_ioctl.h"
+
+/* Busy-wait delays up to this long, and sleep for longer ones */
+#define PCIDTF_PROG_SPIN_NS	(20 * NSEC_PER_USEC)
+
+typedef struct pcidtf_prog_obj {
+	int count;
+	int result_count;
+	PCIDTF_PROG_INSN *insns;
+} pcidtf_prog_t;
+
+static void pcidtf_delete_prog(pcidtf_prog_t * prog)
+{
+	vfree(prog->insns);
+	kfree(prog);
+}
+
+void pcidtf_init_prog(pcidtf_file_t * file)
+{
+	idr_init(&file->prog_idr);
+	mutex_init(&file->prog_lock);
+}
+
+void pcidtf_free_all_progs(pcidtf_file_t * file)
+{
+	pcidtf_prog_t *prog;
+	int id;
+
+	idr_for_each_entry(&file->prog_idr, prog, id)
+		pcidtf_delete_prog(prog);
+	idr_destroy(&file->prog_idr);
+}
+
+/* Check a register or configuration space access of an instruction */
+static int pcidtf_check_access(pcidtf_dev_t * dev, PCIDTF_PROG_INSN * insn)
+{
+	pcidtf_iomap_t *iomap;
+
+	if (insn->off < 0)
+		return -EINVAL;
+	if (insn->bar == PCIDTF_PROG_CFG) {
+		if (insn->len != 1 && insn->len != 2 && insn->len != 4)
+			return -EINVAL;
+		if (insn->off >= dev->pdev->cfg_size ||
+		    insn->len > dev->pdev->cfg_size - insn->off)
+			return -EINVAL;
+		return 0;
+	}
+	if (insn->bar < 0 || insn->bar >= dev->iomap_count)
+		return -EINVAL;
+	iomap = dev->iomap + insn->bar;
+	if (insn->len != 1 && insn->len != 2 && insn->len != 4 &&
+	    !(insn->len == 8 && (iomap->flags & IORESOURCE_MEM)))
+		return -EINVAL;
+	if (insn->off >= iomap->len || insn->len > iomap->len - insn->off)
+		return -EINVAL;
+	return 0;
+}
+
+/*
+ * Validate a program once when it is loaded, so that it can be executed
+ * without checking each step.
+ */
+static int pcidtf_check_prog(pcidtf_dev_t * dev, pcidtf_prog_t * prog)
+{
+	PCIDTF_PROG_INSN *insn;
+	int pc;
+
+	for (pc = 0, insn = prog->insns; pc < prog->count; pc++, insn++) {
+		switch (insn->op) {
+		case PCIDTF_PROG_WRITE:
+		case PCIDTF_PROG_READ:
+		case PCIDTF_PROG_RMW:
+			if (pcidtf_check_access(dev, insn))
+				return -EINVAL;
+			break;
+		case PCIDTF_PROG_POLL:
+			if (pcidtf_check_access(dev, insn) ||
+			    insn->arg > PCIDTF_MAX_PROG_DELAY)
+				return -EINVAL;
+			break;
+		case PCIDTF_PROG_DELAY_NS:
+			if (insn->arg > PCIDTF_MAX_PROG_DELAY)
+				return -EINVAL;
+			break;
+		case PCIDTF_PROG_BRANCH_IF:
+			if (insn->target < 0 || insn->target > prog->count)
+				return -EINVAL;
+			break;
+		case PCIDTF_PROG_LOOP:
+			if (insn->target < 0 || insn->target > pc ||
+			    insn->count <= 0)
+				return -EINVAL;
+			break;
+		case PCIDTF_PROG_STORE_RESULT:
+			if (insn->target < 0 ||
+			    insn->target >= prog->result_count)
+				return -EINVAL;
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+static int pcidtf_prog_access(pcidtf_dev_t * dev, PCIDTF_PROG_INSN * insn,
+			      int read, u64 * val)
+{
+	u32 val32;
+	int ret;
+
+	if (insn->bar != PCIDTF_PROG_CFG)
+		return pcidtf_reg_rw(dev, read, insn->bar, insn->off,
+				     insn->len, val);
+	val32 = (u32)*val;
+	ret = pcidtf_cfg_rw(dev, read, insn->off, insn->len, &val32);
+	*val = val32;
+	return ret;
+}
+
+static void pcidtf_prog_delay(u64 ns)
+{
+	unsigned long us;
+
+	if (ns == 0)
+		return;
+	if (ns <= PCIDTF_PROG_SPIN_NS) {
+		ndelay(ns);
+		return;
+	}
+	/* Leave the timer a little slack so that it can be coalesced */
+	us = div_u64(ns, NSEC_PER_USEC);
+	usleep_range(us, us + us / 8 + 1);
+}
+
+/*
+ * Execute a program. Each step is recorded in the trace, if there is room,
+ * with the time it completed and the accumulator after it.
+ */
+static int pcidtf_exec_prog(pcidtf_dev_t * dev, pcidtf_prog_t * prog,
+			    PCIDTF_PROG_RUN * run, u64 * results,
+			    PCIDTF_PROG_TRACE * trace, int *loops)
+{
+	PCIDTF_PROG_INSN *insn;
+	s64 start, now, deadline;
+	u64 acc = 0, val;
+	int pc = 0, next, ret = 0;
+
+	run->steps = 0;
+	start = now = ktime_to_ns(ktime_get());
+	while (pc < prog->count) {
+		if (run->steps >= run->max_steps) {
+			ret = -E2BIG;
+			break;
+		}
+		insn = prog->insns + pc;
+		next = pc + 1;
+		switch (insn->op) {
+		case PCIDTF_PROG_WRITE:
+			val = insn->val;
+			ret = pcidtf_prog_access(dev, insn, 0, &val);
+			break;
+		case PCIDTF_PROG_READ:
+			ret = pcidtf_prog_access(dev, insn, 1, &acc);
+			break;
+		case PCIDTF_PROG_RMW:
+			ret = pcidtf_prog_access(dev, insn, 1, &acc);
+			if (ret)
+				break;
+			acc = (acc & ~insn->mask) | (insn->val & insn->mask);
+			ret = pcidtf_prog_access(dev, insn, 0, &acc);
+			break;
+		case PCIDTF_PROG_POLL:
+			deadline = now + insn->arg;
+			for (;;) {
+				ret = pcidtf_prog_access(dev, insn, 1, &acc);
+				if (ret || (acc & insn->mask) == insn->val)
+					break;
+				if (ktime_to_ns(ktime_get()) >= deadline) {
+					ret = -ETIMEDOUT;
+					break;
+				}
+				/*
+				 * A poll may spin for as long as a second, so
+				 * yield and stop on signals as POLL_REG does.
+				 */
+				if (signal_pending(current)) {
+					ret = -EINTR;
+					break;
+				}
+				cpu_relax();
+				cond_resched();
+			}
+			break;
+		case PCIDTF_PROG_DELAY_NS:
+			pcidtf_prog_delay(insn->arg);
+			break;
+		case PCIDTF_PROG_BRANCH_IF:
+			if ((acc & insn->mask) == insn->val)
+				next = insn->target;
+			break;
+		case PCIDTF_PROG_LOOP:
+			/* The counter is reset when the loop ends */
+			if (loops[pc] == 0)
+				loops[pc] = insn->count;
+			if (--loops[pc] > 0)
+				next = insn->target;
+			break;
+		case PCIDTF_PROG_STORE_RESULT:
+			results[insn->target] = acc;
+			break;
+		}
+		if (ret)
+			break;
+
+		now = ktime_to_ns(ktime_get());
+		if (run->steps < run->trace_count) {
+			trace[run->steps].pc = pc;
+			trace[run->steps].reserved = 0;
+			trace[run->steps].timestamp = now - start;
+			trace[run->steps].acc = acc;
+		}
+		run->steps++;
+		pc = next;
+
+		/* Stay responsive without disturbing short sequences */
+		if ((run->steps & 1023) == 0) {
+			if (signal_pending(current)) {
+				ret = -EINTR;
+				break;
+			}
+			cond_resched();
+			now = ktime_to_ns(ktime_get());
+		}
+	}
+	run->pc = pc;
+	return ret;
+}
+
+long pcidtf_load_prog(pcidtf_file_t * file, unsigned long arg)
+{
+	PCIDTF_PROG data;
+	pcidtf_prog_t *prog = NULL;
+	long ret = 0;
+	int id;
+
+	if (copy_from_user(&data, (int __user *)arg, sizeof(data))) {
+		ret = -EFAULT;
+		goto done;
+	}
+	if (data.count <= 0 || data.count > PCIDTF_MAX_PROG_INSNS ||
+	    data.result_count < 0 ||
+	    data.result_count > PCIDTF_MAX_PROG_RESULTS) {
+		ret = -EINVAL;
+		goto done;
+	}
+
+	prog = kzalloc(sizeof(pcidtf_prog_t), GFP_KERNEL);
+	if (prog == NULL) {
+		ret = -ENOMEM;
+		goto done;
+	}
+	prog->count = data.count;
+	prog->result_count = data.result_count;
+	prog->insns = vmalloc(sizeof(PCIDTF_PROG_INSN) * data.count);
+	if (prog->insns == NULL) {
+		ret = -ENOMEM;
+		goto done;
+	}
+	if (copy_from_user(prog->insns, data.insns,
+			   sizeof(PCIDTF_PROG_INSN) * data.count)) {
+		ret = -EFAULT;
+		goto done;
+	}
+	ret = pcidtf_check_prog(file->dev, prog);
+	if (ret)
+		goto done;
+
+	/* Reserve the ID and publish the program only once it is returned */
+	mutex_lock(&file->prog_lock);
+	id = idr_alloc(&file->prog_idr, NULL, 1, 0, GFP_KERNEL);
+	mutex_unlock(&file->prog_lock);
+	if (id < 0) {
+		ret = id;
+		goto done;
+	}
+	data.id = id;
+
+	if (copy_to_user((int __user *)arg, &data, sizeof(data))) {
+		mutex_lock(&file->prog_lock);
+		idr_remove(&file->prog_idr, id);
+		mutex_unlock(&file->prog_lock);
+		ret = -EFAULT;
+		goto done;
+	}
+	mutex_lock(&file->prog_lock);
+	idr_replace(&file->prog_idr, prog, id);
+	mutex_unlock(&file->prog_lock);
+	prog = NULL;
+
+ done:
+	if (prog)
+		pcidtf_delete_prog(prog);
+	return ret;
+}
+
+long pcidtf_run_prog(pcidtf_file_t * file, unsigned long arg)
+{
+	PCIDTF_PROG_RUN data;
+	pcidtf_prog_t *prog;
+	PCIDTF_PROG_TRACE *trace = NULL;
+	u64 *results = NULL;
+	int *loops = NULL;
+	long ret = 0, err;
+
+	if (copy_from_user(&data, (int __user *)arg, sizeof(data)))
+		return -EFAULT;
+	if (data.max_steps < 0 || data.result_count < 0 ||
+	    data.trace_count < 0)
+		return -EINVAL;
+	if (data.max_steps == 0 || data.max_steps > PCIDTF_MAX_PROG_STEPS)
+		data.max_steps = PCIDTF_MAX_PROG_STEPS;
+	if (data.trace_count > PCIDTF_MAX_PROG_TRACE)
+		data.trace_count = PCIDTF_MAX_PROG_TRACE;
+
+	/* Programs of a file run one at a time */
+	mutex_lock(&file->prog_lock);
+	prog = idr_find(&file->prog_idr, data.id);
+	if (prog == NULL) {
+		ret = -EINVAL;
+		goto done;
+	}
+	if (data.result_count > prog->result_count)
+		data.result_count = prog->result_count;
+
+	results = kcalloc(prog->result_count + 1, sizeof(u64), GFP_KERNEL);
+	loops = kcalloc(prog->count, sizeof(int), GFP_KERNEL);
+	if (data.trace_count)
+		trace = vmalloc(sizeof(PCIDTF_PROG_TRACE) * data.trace_count);
+	if (results == NULL || loops == NULL ||
+	    (data.trace_count && trace == NULL)) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	ret = pcidtf_exec_prog(file->dev, prog, &data, results, trace, loops);
+
+	/* Results are returned even if the program stopped on an error */
+	err = 0;
+	if (data.result_count &&
+	    copy_to_user(data.results, results,
+			 sizeof(u64) * data.result_count))
+		err = -EFAULT;
+	if (data.trace_count && data.steps &&
+	    copy_to_user(data.trace, trace,
+			 sizeof(PCIDTF_PROG_TRACE) *
+			 min(data.steps, data.trace_count)))
+		err = -EFAULT;
+	if (copy_to_user((int __user *)arg, &data, sizeof(data)))
+		err = -EFAULT;
+	if (err)
+		ret = err;
+
+ done:
+	mutex_unlock(&file->prog_lock);
+	vfree(trace);
+	kfree(loops);
+	kfree(results);
+	return ret;
+}
+
+long pcidtf_free_prog(pcidtf_file_t * file, unsigned long arg)
+{
+	pcidtf_prog_t *prog;
+	int id = 0;
+
+	if (copy_from_user(&id, (int __user *)arg, sizeof(id)))
+		return -EFAULT;
+
+	mutex_lock(&file->prog_lock);
+	prog = idr_find(&file->prog_idr, id);
+	if (prog)
+		idr_remove(&file->prog_idr, id);
+	mutex_unlock(&file->prog_lock);
+	if (prog == NULL)
+		return -EINVAL;
+	pcidtf_delete_prog(prog);
+	return 0;
+}
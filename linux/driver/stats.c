@@ -0,0 +1,411 @@
+/*
+ * PCI Device Test Framework
+ * This file implements operation counters and register access latency
+ * statistics.
+ *
+ * Copyright (C) 2013 Hiromitsu Sakamoto
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ */
+
+#include <linux/module.h>
+#include <linux/pci.h>
+#include <linux/fs.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <asm/uaccess.h>
+
+#include "pcidtf.h"
+#include "pcidtf_ioctl.h"
+
+bool pcidtf_lat_enabled = true;
+module_param_named(reg_latency, pcidtf_lat_enabled, bool, 0644);
+MODULE_PARM_DESC(reg_latency, "Measure register access latency "
+		 "(default: true)");
+
+static struct dentry *pcidtf_debugfs_root;
+
+/* Names of the ioctls shown in sysfs, indexed by the ioctl number */
+static const char *const pcidtf_op_names[PCIDTF_STATS_OPS] = {
+	"get_info", "read_cfg", "write_cfg", "get_reg", "read_reg",
+	"write_reg", "alloc_dma", "free_dma", "read_dma", "write_dma",
+	"get_dma_info", "batch", "read_block", "write_block",
+	"read_cfg_block", "write_cfg_block", "poll_reg", "set_irq",
+	"set_irq_event", "wait_irq", "unmask_irq", "map_user",
+	"get_pool_stats", "alloc_stream_dma", "sync_dma", "load_prog",
+	"run_prog", "free_prog", "get_reg_stats", "reset_reg_stats",
+	"get_stats", "run_bench", "get_desc",
+};
+
+/* Count an ioctl call and the time it took since start */
+void pcidtf_count_op(pcidtf_dev_t * dev, unsigned int cmd, long ret,
+		     s64 start)
+{
+	PCIDTF_OP_STATS __percpu *op;
+
+	if (_IOC_NR(cmd) >= PCIDTF_STATS_OPS)
+		return;
+	op = &dev->stats->ops[_IOC_NR(cmd)];
+	this_cpu_inc(op->calls);
+	if (ret < 0)
+		this_cpu_inc(op->errors);
+	this_cpu_add(op->time, ktime_to_ns(ktime_get()) - start);
+}
+
+/* Sum the counters of all CPUs */
+static void pcidtf_sum_stats(pcidtf_dev_t * dev, PCIDTF_DEV_STATS * sum)
+{
+	PCIDTF_DEV_STATS *stats;
+	int cpu, i;
+
+	memset(sum, 0, sizeof(PCIDTF_DEV_STATS));
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(dev->stats, cpu);
+		for (i = 0; i < PCIDTF_STATS_OPS; i++) {
+			sum->ops[i].calls += stats->ops[i].calls;
+			sum->ops[i].bytes += stats->ops[i].bytes;
+			sum->ops[i].errors += stats->ops[i].errors;
+			sum->ops[i].time += stats->ops[i].time;
+		}
+	}
+}
+
+/* Show one counter summed over all operations */
+static ssize_t pcidtf_show_total(struct device *cdev, char *buf,
+				 size_t field)
+{
+	pcidtf_dev_t *dev = dev_get_drvdata(cdev);
+	PCIDTF_DEV_STATS *sum;
+	u64 total = 0;
+	int i;
+
+	sum = kmalloc(sizeof(PCIDTF_DEV_STATS), GFP_KERNEL);
+	if (sum == NULL)
+		return -ENOMEM;
+	pcidtf_sum_stats(dev, sum);
+	for (i = 0; i < PCIDTF_STATS_OPS; i++)
+		total += *(u64 *) ((char *)&sum->ops[i] + field);
+	kfree(sum);
+	return sprintf(buf, "%llu\n", total);
+}
+
+#define PCIDTF_TOTAL_ATTR(name, field)					\
+static ssize_t name##_show(struct device *cdev,				\
+			   struct device_attribute *attr, char *buf)	\
+{									\
+	return pcidtf_show_total(cdev, buf,				\
+				 offsetof(PCIDTF_OP_STATS, field));	\
+}									\
+static DEVICE_ATTR_RO(name)
+
+PCIDTF_TOTAL_ATTR(calls, calls);
+PCIDTF_TOTAL_ATTR(bytes, bytes);
+PCIDTF_TOTAL_ATTR(errors, errors);
+PCIDTF_TOTAL_ATTR(time_ns, time);
+
+/* Show a line of "name calls bytes errors time_ns" per operation used */
+static ssize_t ops_show(struct device *cdev, struct device_attribute *attr,
+			char *buf)
+{
+	pcidtf_dev_t *dev = dev_get_drvdata(cdev);
+	PCIDTF_DEV_STATS *sum;
+	PCIDTF_OP_STATS *op;
+	ssize_t len = 0;
+	int i;
+
+	sum = kmalloc(sizeof(PCIDTF_DEV_STATS), GFP_KERNEL);
+	if (sum == NULL)
+		return -ENOMEM;
+	pcidtf_sum_stats(dev, sum);
+	for (i = 0, op = sum->ops; i < PCIDTF_STATS_OPS; i++, op++) {
+		if (op->calls == 0)
+			continue;
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 "%s %llu %llu %llu %llu\n",
+				 pcidtf_op_names[i] ? pcidtf_op_names[i] :
+				 "unknown", op->calls, op->bytes, op->errors,
+				 op->time);
+	}
+	kfree(sum);
+	return len;
+}
+
+static DEVICE_ATTR_RO(ops);
+
+static struct attribute *pcidtf_stats_attrs[] = {
+	&dev_attr_calls.attr,
+	&dev_attr_bytes.attr,
+	&dev_attr_errors.attr,
+	&dev_attr_time_ns.attr,
+	&dev_attr_ops.attr,
+	NULL,
+};
+
+static const struct attribute_group pcidtf_stats_group = {
+	.name = "stats",
+	.attrs = pcidtf_stats_attrs,
+};
+
+const struct attribute_group *pcidtf_stats_groups[] = {
+	&pcidtf_stats_group,
+	NULL,
+};
+
+static void pcidtf_reset_lat(pcidtf_lat_t * lat)
+{
+	int i;
+
+	atomic64_set(&lat->count, 0);
+	atomic64_set(&lat->sum, 0);
+	atomic64_set(&lat->min, S64_MAX);
+	atomic64_set(&lat->max, 0);
+	for (i = 0; i < PCIDTF_LAT_BUCKETS; i++)
+		atomic64_set(&lat->buckets[i], 0);
+}
+
+static void pcidtf_reset_bar_lat(pcidtf_dev_t * dev, int bar)
+{
+	int w;
+
+	for (w = 0; w < PCIDTF_LAT_WIDTHS; w++) {
+		pcidtf_reset_lat(&dev->reg_lat[bar][w][0]);
+		pcidtf_reset_lat(&dev->reg_lat[bar][w][1]);
+	}
+}
+
+/* Record the latency of a register access started at start */
+void pcidtf_lat_end(pcidtf_dev_t * dev, int read, int bar, int len,
+		    s64 start)
+{
+	pcidtf_lat_t *lat;
+	s64 ns, old, prev;
+
+	if (!pcidtf_lat_enabled || start == 0)
+		return;
+	ns = ktime_to_ns(ktime_get()) - start;
+	lat = &dev->reg_lat[bar][ilog2(len)][!read];
+
+	atomic64_inc(&lat->buckets[pcidtf_lat_bucket(ns)]);
+	atomic64_add(ns, &lat->sum);
+	atomic64_inc(&lat->count);
+
+	for (old = atomic64_read(&lat->min); ns < old; old = prev) {
+		prev = atomic64_cmpxchg(&lat->min, old, ns);
+		if (prev == old)
+			break;
+	}
+	for (old = atomic64_read(&lat->max); ns > old; old = prev) {
+		prev = atomic64_cmpxchg(&lat->max, old, ns);
+		if (prev == old)
+			break;
+	}
+}
+
+static void pcidtf_read_lat(pcidtf_lat_t * lat, PCIDTF_REG_STATS * st)
+{
+	int i;
+
+	st->count = atomic64_read(&lat->count);
+	st->sum = atomic64_read(&lat->sum);
+	st->min = st->count ? atomic64_read(&lat->min) : 0;
+	st->max = atomic64_read(&lat->max);
+	for (i = 0; i < PCIDTF_LAT_BUCKETS; i++)
+		st->buckets[i] = atomic64_read(&lat->buckets[i]);
+}
+
+/* Return the upper bound of the bucket holding the given percentile */
+static u64 pcidtf_lat_percentile(PCIDTF_REG_STATS * st, int pct)
+{
+	u64 total = 0, target;
+	int i;
+
+	for (i = 0; i < PCIDTF_LAT_BUCKETS; i++)
+		total += st->buckets[i];
+	if (total == 0)
+		return 0;
+	target = div_u64(total * pct + 99, 100);
+	for (i = 0, total = 0; i < PCIDTF_LAT_BUCKETS; i++) {
+		total += st->buckets[i];
+		if (total >= target)
+			break;
+	}
+	return min_t(u64, (2ULL << i) - 1, st->max);
+}
+
+static int pcidtf_lat_show(struct seq_file *m, void *v)
+{
+	pcidtf_dev_t *dev = m->private;
+	PCIDTF_REG_STATS st;
+	int bar, w, dir, i;
+
+	for (bar = 0; bar < dev->iomap_count; bar++) {
+		for (w = 0; w < PCIDTF_LAT_WIDTHS; w++) {
+			for (dir = 0; dir < 2; dir++) {
+				pcidtf_read_lat(&dev->reg_lat[bar][w][dir],
+						&st);
+				if (st.count == 0)
+					continue;
+				seq_printf(m, "bar %d %s%d: count %llu, "
+					   "min %llu, avg %llu, p50 %llu, "
+					   "p99 %llu, max %llu (ns)\n", bar,
+					   dir ? "write" : "read", 8 << w,
+					   st.count, st.min,
+					   div64_u64(st.sum, st.count),
+					   pcidtf_lat_percentile(&st, 50),
+					   pcidtf_lat_percentile(&st, 99),
+					   st.max);
+				for (i = 0; i < PCIDTF_LAT_BUCKETS; i++) {
+					if (st.buckets[i])
+						seq_printf(m, "  <%llu: %llu\n",
+							   2ULL << i,
+							   st.buckets[i]);
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+static int pcidtf_lat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pcidtf_lat_show, inode->i_private);
+}
+
+/* Writing anything resets all histograms of the device */
+static ssize_t pcidtf_lat_write(struct file *file, const char __user * buf,
+				size_t count, loff_t * pos)
+{
+	struct seq_file *m = file->private_data;
+	pcidtf_dev_t *dev = m->private;
+	int bar;
+
+	for (bar = 0; bar < 6; bar++)
+		pcidtf_reset_bar_lat(dev, bar);
+	return count;
+}
+
+static const struct file_operations pcidtf_lat_fops = {
+	.owner = THIS_MODULE,
+	.open = pcidtf_lat_open,
+	.read = seq_read,
+	.write = pcidtf_lat_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+void pcidtf_init_debugfs(void)
+{
+	pcidtf_debugfs_root = debugfs_create_dir("pcidtf", NULL);
+}
+
+void pcidtf_exit_debugfs(void)
+{
+	debugfs_remove_recursive(pcidtf_debugfs_root);
+}
+
+int pcidtf_init_stats(pcidtf_dev_t * dev)
+{
+	int bar;
+
+	dev->stats = alloc_percpu(PCIDTF_DEV_STATS);
+	if (dev->stats == NULL)
+		return -ENOMEM;
+	for (bar = 0; bar < 6; bar++)
+		pcidtf_reset_bar_lat(dev, bar);
+
+	/* Statistics work without debugfs, so failures are ignored */
+	if (IS_ERR_OR_NULL(pcidtf_debugfs_root))
+		return 0;
+	dev->debugfs = debugfs_create_dir(pci_name(dev->pdev),
+					  pcidtf_debugfs_root);
+	if (!IS_ERR_OR_NULL(dev->debugfs))
+		debugfs_create_file("reg_latency", 0600, dev->debugfs, dev,
+				    &pcidtf_lat_fops);
+	return 0;
+}
+
+void pcidtf_exit_stats(pcidtf_dev_t * dev)
+{
+	debugfs_remove_recursive(dev->debugfs);
+	dev->debugfs = NULL;
+	free_percpu(dev->stats);
+	dev->stats = NULL;
+}
+
+long pcidtf_get_stats(pcidtf_dev_t * dev, unsigned long arg)
+{
+	PCIDTF_DEV_STATS *data;
+	long ret = 0;
+
+	data = kmalloc(sizeof(PCIDTF_DEV_STATS), GFP_KERNEL);
+	if (data == NULL) {
+		ret = -ENOMEM;
+		goto done;
+	}
+	pcidtf_sum_stats(dev, data);
+
+	if (copy_to_user((void __user *)arg, data, sizeof(*data)))
+		ret = -EFAULT;
+
+ done:
+	kfree(data);
+	return ret;
+}
+
+long pcidtf_get_reg_stats(pcidtf_dev_t * dev, unsigned long arg)
+{
+	PCIDTF_REG_STATS data;
+	long ret = 0;
+
+	if (copy_from_user(&data, (int __user *)arg, sizeof(data))) {
+		ret = -EFAULT;
+		goto done;
+	}
+	if (data.bar < 0 || data.bar >= dev->iomap_count ||
+	    data.width <= 0 || data.width > 8 || !is_power_of_2(data.width) ||
+	    (data.write != 0 && data.write != 1)) {
+		ret = -EINVAL;
+		goto done;
+	}
+	pcidtf_read_lat(&dev->reg_lat[data.bar][ilog2(data.width)][data.write],
+			&data);
+
+	if (copy_to_user((int __user *)arg, &data, sizeof(data)))
+		ret = -EFAULT;
+
+ done:
+	return ret;
+}
+
+/* Reset the histograms of a BAR, or of all BARs if it is negative */
+long pcidtf_reset_reg_stats(pcidtf_dev_t * dev, unsigned long arg)
+{
+	int bar;
+
+	if (copy_from_user(&bar, (int __user *)arg, sizeof(bar)))
+		return -EFAULT;
+	if (bar >= dev->iomap_count)
+		return -EINVAL;
+	if (bar >= 0) {
+		pcidtf_reset_bar_lat(dev, bar);
+	} else {
+		for (bar = 0; bar < 6; bar++)
+			pcidtf_reset_bar_lat(dev, bar);
+	}
+	return 0;
+}
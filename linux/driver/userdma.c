@@ -0,0 +1,433 @@
+/*
+ * PCI Device Test Framework
+ * This file implements DMA mapping of pinned user memory and the
+ * registration cache that keeps recently used mappings pinned.
+ *
+ * Copyright (C) 2013 Hiromitsu Sakamoto
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ */
+
+#include <linux/pci.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+#include <linux/version.h>
+#include <linux/highmem.h>
+#include <linux/sched.h>
+#include <asm/uaccess.h>
+
+#include "pcidtf.h"
+#include "pcidtf_ioctl.h"
+
+static int pcidtf_pin_pages(unsigned long start, int npages,
+			    struct page **pages)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+	return pin_user_pages_fast(start, npages, FOLL_WRITE | FOLL_LONGTERM,
+				   pages);
+#else
+	/* The third argument is "write" before 4.13 and FOLL_WRITE after */
+	return get_user_pages_fast(start, npages, 1, pages);
+#endif
+}
+
+static void pcidtf_unpin_pages(struct page **pages, int npages)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+	unpin_user_pages_dirty_lock(pages, npages, true);
+#else
+	int i;
+
+	for (i = 0; i < npages; i++) {
+		set_page_dirty_lock(pages[i]);
+		put_page(pages[i]);
+	}
+#endif
+}
+
+void pcidtf_release_user_dma(pcidtf_dma_t * dma)
+{
+	if (dma->nents) {
+		dma_unmap_sg(&dma->pdev->dev, dma->sgt.sgl, dma->sgt.orig_nents,
+			     DMA_BIDIRECTIONAL);
+	}
+	if (dma->sgt.sgl)
+		sg_free_table(&dma->sgt);
+	if (dma->pages) {
+		pcidtf_unpin_pages(dma->pages, dma->npages);
+		vfree(dma->pages);
+	}
+}
+
+/*
+ * Copy between a pinned user buffer and another user buffer for the
+ * READ_DMA and WRITE_DMA requests.
+ */
+int pcidtf_copy_user_dma(pcidtf_dma_t * dma, int read, int off,
+			 void __user * buf, int len)
+{
+	unsigned long pos = offset_in_page(dma->start) + off;
+	struct page *page;
+	unsigned char *bp;
+	int n, ret = 0;
+
+	while (len > 0) {
+		page = dma->pages[pos >> PAGE_SHIFT];
+		n = min_t(int, len, PAGE_SIZE - offset_in_page(pos));
+		bp = (unsigned char *)kmap(page) + offset_in_page(pos);
+		if (read)
+			ret = copy_to_user(buf, bp, n) ? -EFAULT : 0;
+		else
+			ret = copy_from_user(bp, buf, n) ? -EFAULT : 0;
+		kunmap(page);
+		if (ret)
+			break;
+		buf += n;
+		pos += n;
+		len -= n;
+	}
+	return ret;
+}
+
+void pcidtf_init_ucache(pcidtf_file_t * file)
+{
+	mutex_init(&file->ucache_mutex);
+	spin_lock_init(&file->ucache_lock);
+	INIT_LIST_HEAD(&file->ucache);
+}
+
+/* Release the cache references of evicted registrations */
+static void pcidtf_evict_ucache(struct list_head *evict)
+{
+	pcidtf_dma_t *dma, *tmp;
+
+	list_for_each_entry_safe(dma, tmp, evict, link) {
+		list_del(&dma->link);
+		pcidtf_put_dma(dma);
+	}
+}
+
+/*
+ * Return a registration to the cache when its DMA buffer ID is freed. The
+ * least recently used idle registration is unpinned when the cache is full.
+ */
+void pcidtf_put_ucache(pcidtf_file_t * file, pcidtf_dma_t * dma)
+{
+	LIST_HEAD(evict);
+
+	spin_lock(&file->ucache_lock);
+	if (dma->stale) {
+		list_move(&dma->link, &evict);
+	} else {
+		dma->idle = true;
+		list_move(&dma->link, &file->ucache);
+		if (++file->ucache_idle > PCIDTF_UCACHE_MAX) {
+			list_for_each_entry_reverse(dma, &file->ucache, link) {
+				if (dma->idle) {
+					list_move(&dma->link, &evict);
+					file->ucache_idle--;
+					break;
+				}
+			}
+		}
+	}
+	spin_unlock(&file->ucache_lock);
+	pcidtf_evict_ucache(&evict);
+}
+
+/* Take an idle registration of the same buffer out of the cache */
+static pcidtf_dma_t *pcidtf_get_ucache(pcidtf_file_t * file,
+				       unsigned long start, int len)
+{
+	pcidtf_dma_t *dma, *found = NULL;
+
+	spin_lock(&file->ucache_lock);
+	list_for_each_entry(dma, &file->ucache, link) {
+		if (dma->idle && dma->start == start && dma->len == len) {
+			dma->idle = false;
+			file->ucache_idle--;
+			/* The old ID may already belong to another buffer */
+			dma->id = 0;
+			kref_get(&dma->ref);
+			found = dma;
+			break;
+		}
+	}
+	spin_unlock(&file->ucache_lock);
+	return found;
+}
+
+#ifdef CONFIG_MMU_NOTIFIER
+/*
+ * Invalidate registrations overlapping an address range that is being
+ * unmapped or changed. Idle ones are unpinned now, and ones in use are
+ * unpinned when their IDs are freed.
+ */
+static int pcidtf_invalidate_ucache(pcidtf_file_t * file, unsigned long start,
+				    unsigned long end, bool blockable)
+{
+	pcidtf_dma_t *dma, *tmp;
+	LIST_HEAD(evict);
+
+	spin_lock(&file->ucache_lock);
+	list_for_each_entry_safe(dma, tmp, &file->ucache, link) {
+		if (dma->start >= end || dma->start + dma->len <= start)
+			continue;
+		if (dma->idle && !blockable) {
+			/* Unpinning may sleep, so let the caller retry */
+			spin_unlock(&file->ucache_lock);
+			return -EAGAIN;
+		}
+		dma->stale = true;
+		if (dma->idle) {
+			list_move(&dma->link, &evict);
+			file->ucache_idle--;
+		}
+	}
+	spin_unlock(&file->ucache_lock);
+	pcidtf_evict_ucache(&evict);
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+static int pcidtf_mn_invalidate_range_start(struct mmu_notifier *mn,
+					    const struct mmu_notifier_range
+					    *range)
+{
+	pcidtf_file_t *file = container_of(mn, pcidtf_file_t, mn);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
+	return pcidtf_invalidate_ucache(file, range->start, range->end,
+					mmu_notifier_range_blockable(range));
+#else
+	return pcidtf_invalidate_ucache(file, range->start, range->end,
+					range->blockable);
+#endif
+}
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+static int pcidtf_mn_invalidate_range_start(struct mmu_notifier *mn,
+					    struct mm_struct *mm,
+					    unsigned long start,
+					    unsigned long end, bool blockable)
+{
+	pcidtf_file_t *file = container_of(mn, pcidtf_file_t, mn);
+
+	return pcidtf_invalidate_ucache(file, start, end, blockable);
+}
+#else
+static void pcidtf_mn_invalidate_range_start(struct mmu_notifier *mn,
+					     struct mm_struct *mm,
+					     unsigned long start,
+					     unsigned long end)
+{
+	pcidtf_file_t *file = container_of(mn, pcidtf_file_t, mn);
+
+	pcidtf_invalidate_ucache(file, start, end, true);
+}
+#endif
+
+static void pcidtf_mn_release(struct mmu_notifier *mn, struct mm_struct *mm)
+{
+	pcidtf_file_t *file = container_of(mn, pcidtf_file_t, mn);
+
+	pcidtf_invalidate_ucache(file, 0, ULONG_MAX, true);
+}
+
+static const struct mmu_notifier_ops pcidtf_mn_ops = {
+	.invalidate_range_start = pcidtf_mn_invalidate_range_start,
+	.release = pcidtf_mn_release,
+};
+
+/*
+ * Start watching the address space of the caller on its first registration.
+ * Registrations from any other process sharing the file are not cached.
+ */
+static bool pcidtf_enable_ucache(pcidtf_file_t * file)
+{
+	bool enabled;
+
+	mutex_lock(&file->ucache_mutex);
+	if (file->mm == NULL) {
+		file->mn.ops = &pcidtf_mn_ops;
+		if (mmu_notifier_register(&file->mn, current->mm) == 0)
+			file->mm = current->mm;
+	}
+	enabled = (file->mm == current->mm);
+	mutex_unlock(&file->ucache_mutex);
+	return enabled;
+}
+#else
+static bool pcidtf_enable_ucache(pcidtf_file_t * file)
+{
+	return false;
+}
+#endif
+
+/*
+ * Unpin all cached registrations when the file is closed. Registrations
+ * still in use keep their IDs and are unpinned when the IDs are freed.
+ */
+void pcidtf_flush_ucache(pcidtf_file_t * file)
+{
+	pcidtf_dev_t *dev = file->dev;
+	pcidtf_dma_t *dma;
+	LIST_HEAD(evict);
+
+#ifdef CONFIG_MMU_NOTIFIER
+	if (file->mm)
+		mmu_notifier_unregister(&file->mn, file->mm);
+#endif
+	spin_lock(&dev->dma_lock);
+	list_for_each_entry(dma, &file->ucache, link)
+		dma->owner = NULL;
+	spin_unlock(&dev->dma_lock);
+
+	spin_lock(&file->ucache_lock);
+	list_splice_init(&file->ucache, &evict);
+	file->ucache_idle = 0;
+	spin_unlock(&file->ucache_lock);
+	pcidtf_evict_ucache(&evict);
+}
+
+/* Pin a user buffer and map it for DMA */
+static int pcidtf_pin_user_dma(pcidtf_dev_t * dev, pcidtf_dma_t * dma)
+{
+	int npages, ret;
+
+	npages = (PAGE_ALIGN(dma->start + dma->len) -
+		  (dma->start & PAGE_MASK)) >> PAGE_SHIFT;
+	dma->pages = vzalloc(sizeof(struct page *) * npages);
+	if (dma->pages == NULL)
+		return -ENOMEM;
+	ret = pcidtf_pin_pages(dma->start & PAGE_MASK, npages, dma->pages);
+	if (ret < 0)
+		return ret;
+	dma->npages = ret;
+	if (ret != npages)
+		return -EFAULT;
+
+	ret = sg_alloc_table_from_pages(&dma->sgt, dma->pages, npages,
+					offset_in_page(dma->start), dma->len,
+					GFP_KERNEL);
+	if (ret)
+		return ret;
+	dma->nents = dma_map_sg(&dev->pdev->dev, dma->sgt.sgl,
+				dma->sgt.orig_nents, DMA_BIDIRECTIONAL);
+	if (dma->nents == 0)
+		return -EIO;
+	dma->paddr = sg_dma_address(dma->sgt.sgl);
+	return 0;
+}
+
+/*
+ * Pin a user buffer and map it for DMA. The bus address and length of each
+ * mapped segment are returned, and the mapping is released by freeing the
+ * returned DMA buffer ID. A freed mapping stays pinned in the registration
+ * cache of the file until the memory is unmapped, so that registering the
+ * same buffer again does not pin and map it again.
+ */
+long pcidtf_map_user(pcidtf_file_t * file, unsigned long arg)
+{
+	pcidtf_dev_t *dev = file->dev;
+	PCIDTF_SG_INFO data;
+	PCIDTF_SG_ENTRY seg;
+	pcidtf_dma_t *dma = NULL;
+	struct scatterlist *sg;
+	unsigned long start;
+	bool cache;
+	int i, id = 0, ret = 0;
+
+	if (copy_from_user(&data, (int __user *)arg, sizeof(data))) {
+		ret = -EFAULT;
+		goto done;
+	}
+	if (data.len <= 0 || data.count < 0) {
+		ret = -EINVAL;
+		goto done;
+	}
+	start = (unsigned long)data.buf;
+	cache = !(data.flags & PCIDTF_SG_NOCACHE) && pcidtf_enable_ucache(file);
+	data.flags &= ~PCIDTF_SG_CACHED;
+
+	if (cache)
+		dma = pcidtf_get_ucache(file, start, data.len);
+	if (dma) {
+		data.flags |= PCIDTF_SG_CACHED;
+	} else {
+		dma = pcidtf_new_dma(dev, PCIDTF_DMA_USER, data.len);
+		if (dma == NULL) {
+			ret = -ENOMEM;
+			goto done;
+		}
+		INIT_LIST_HEAD(&dma->link);
+		dma->start = start;
+		ret = pcidtf_pin_user_dma(dev, dma);
+		if (ret)
+			goto done;
+		if (cache) {
+			/* The cache holds its own reference */
+			kref_get(&dma->ref);
+			dma->owner = file;
+			spin_lock(&file->ucache_lock);
+			list_add(&dma->link, &file->ucache);
+			spin_unlock(&file->ucache_lock);
+		}
+	}
+
+	/* Fail if the caller cannot hold all segments, but report the count */
+	if (data.count < dma->nents) {
+		data.count = dma->nents;
+		ret = -ENOSPC;
+		goto copy;
+	}
+	for_each_sg(dma->sgt.sgl, sg, dma->nents, i) {
+		seg.addr = sg_dma_address(sg);
+		seg.len = sg_dma_len(sg);
+		if (copy_to_user(data.segs + i, &seg, sizeof(seg))) {
+			ret = -EFAULT;
+			goto done;
+		}
+	}
+	data.count = dma->nents;
+
+	ret = pcidtf_add_dma(dev, dma);
+	if (ret < 0)
+		goto done;
+	data.id = id = ret;
+	ret = 0;
+
+ copy:
+	if (copy_to_user((int __user *)arg, &data, sizeof(data)))
+		ret = -EFAULT;
+
+ done:
+	if (ret && id) {
+		pcidtf_remove_dma(dev, id, file);
+	} else if (ret && dma) {
+		/*
+		 * Before the ID is published, return a cached registration to
+		 * the cache and drop only the reference of this call.
+		 */
+		if (dma->owner)
+			pcidtf_put_ucache(file, dma);
+		pcidtf_put_dma(dma);
+	}
+	return ret;
+}
@@ -48,16 +48,23 @@ static void show_app_info(PCIDTF * dtf)
 void dev_cmd(PCIDTF * dtf, int argc, char *argv[])
 {
 	enum {
-		CMD_INFO
+		CMD_INFO,
+		CMD_STATS
 	} cmd;
 	PCIDTF_DEV *dev;
-	int params[1];
+	PCIDTF_DEV_DESC desc;
+	PCIDTF_DEV_STATS stats;
+	PCIDTF_OP_STATS *op;
+	int params[1], i;
 
 	if (argc == 4 && strcasecmp(argv[2], "info") == 0) {
 		cmd = CMD_INFO;
+	} else if (argc == 4 && strcasecmp(argv[2], "stats") == 0) {
+		cmd = CMD_STATS;
 	} else {
 		show_app_info(dtf);
 		fprintf(stderr, "Usage: " APP_NAME " dev info <idx>\n");
+		fprintf(stderr, "       " APP_NAME " dev stats <idx>\n");
 		exit(1);
 	}
 	xpcf_get_int_params(argc - 3, argv + 3, params);
@@ -68,6 +75,41 @@ void dev_cmd(PCIDTF * dtf, int argc, char *argv[])
 	if (cmd == CMD_INFO) {
 		printf("bus=%u, devfn=%u\n", pcidtf_dev_get_bus(dev),
 		       pcidtf_dev_get_devfn(dev));
+		if (pcidtf_dev_get_desc(dev, &desc) == 0) {
+			printf("vendor=%04X, device=%04X, subvendor=%04X, "
+			       "subdevice=%04X, class=%06X, rev=%02X\n",
+			       desc.vendor, desc.device, desc.subvendor,
+			       desc.subdevice, desc.class_code, desc.revision);
+			for (i = 0; i < desc.reg_count; i++) {
+				printf("bar %d - addr=0x%llX, len=0x%llX%s%s%s\n",
+				       desc.bars[i].bar, desc.bars[i].addr,
+				       desc.bars[i].len,
+				       desc.bars[i].flags & PCIDTF_BAR_IO ?
+				       ", io" : ", mem",
+				       desc.bars[i].flags & PCIDTF_BAR_64BIT ?
+				       ", 64-bit" : "",
+				       desc.bars[i].flags &
+				       PCIDTF_BAR_PREFETCH ? ", prefetchable" :
+				       "");
+			}
+			printf("irq: intx=%s, msi=%d, msix=%d, dma buffers=%d\n",
+			       desc.irq_caps &
+			       PCIDTF_IRQ_CAP(PCIDTF_IRQ_INTX) ? "yes" : "no",
+			       desc.msi_count, desc.msix_count,
+			       desc.dma_count);
+		}
+	} else if (cmd == CMD_STATS) {
+		if (pcidtf_dev_get_stats(dev, &stats)) {
+			fprintf(stderr, "ERROR: failed to get statistics\n");
+			exit(1);
+		}
+		for (i = 0, op = stats.ops; i < PCIDTF_STATS_OPS; i++, op++) {
+			if (op->calls == 0)
+				continue;
+			printf("ioctl %d - calls=%llu, bytes=%llu, errors=%llu, "
+			       "time=%llu ns\n", i, op->calls, op->bytes,
+			       op->errors, op->time);
+		}
 	}
 }
 
@@ -117,16 +159,46 @@ void cfg_cmd(PCIDTF * dtf, int argc, char *argv[])
 	}
 }
 
+void show_reg_stats(PCIDTF_DEV * dev)
+{
+	PCIDTF_IOMAP *iomap;
+	PCIDTF_REG_STATS stats;
+	int bar, width, write;
+
+	for (bar = 0; bar < pcidtf_dev_get_iomap_count(dev); bar++) {
+		iomap = pcidtf_dev_get_iomap(dev, bar);
+		for (width = 1; width <= 8; width <<= 1) {
+			for (write = 0; write < 2; write++) {
+				if (pcidtf_iomap_get_reg_stats(iomap, width,
+							       write, &stats)
+				    || stats.count == 0)
+					continue;
+				printf("Register latency - bar=%d, %s%d, "
+				       "count=%llu, min=%llu, avg=%llu, "
+				       "p50=%llu, p99=%llu, max=%llu (ns)\n",
+				       bar, write ? "write" : "read",
+				       width * 8, stats.count, stats.min,
+				       stats.sum / stats.count,
+				       pcidtf_reg_stats_percentile(&stats, 50),
+				       pcidtf_reg_stats_percentile(&stats, 99),
+				       stats.max);
+			}
+		}
+	}
+}
+
 void reg_cmd(PCIDTF * dtf, int argc, char *argv[])
 {
 	enum {
 		CMD_INFO,
 		CMD_READ,
-		CMD_WRITE
+		CMD_WRITE,
+		CMD_STATS,
+		CMD_RESET
 	} cmd;
 	PCIDTF_DEV *dev;
 	PCIDTF_IOMAP *iomap;
-	int params[5];
+	int params[4];
 	UINT64 val;
 
 	if (argc == 5 && strcasecmp(argv[2], "info") == 0) {
@@ -135,6 +207,10 @@ void reg_cmd(PCIDTF * dtf, int argc, char *argv[])
 		cmd = CMD_READ;
 	} else if (argc == 8 && strcasecmp(argv[2], "write") == 0) {
 		cmd = CMD_WRITE;
+	} else if (argc == 4 && strcasecmp(argv[2], "stats") == 0) {
+		cmd = CMD_STATS;
+	} else if (argc == 4 && strcasecmp(argv[2], "reset") == 0) {
+		cmd = CMD_RESET;
 	} else {
 		show_app_info(dtf);
 		fprintf(stderr, "Usage: " APP_NAME " reg info <idx> <bar>\n");
@@ -144,13 +220,29 @@ void reg_cmd(PCIDTF * dtf, int argc, char *argv[])
 		fprintf(stderr,
 			"       " APP_NAME
 			" reg write <idx> <bar> <off> <len> <val>\n");
+		fprintf(stderr, "       " APP_NAME " reg stats <idx>\n");
+		fprintf(stderr, "       " APP_NAME " reg reset <idx>\n");
 		exit(1);
 	}
-	xpcf_get_int_params(argc - 3, argv + 3, params);
+	xpcf_get_int_params(cmd == CMD_WRITE ? 4 : argc - 3, argv + 3, params);
+	if (cmd == CMD_WRITE)
+		val = strtoull(argv[7], NULL, 0);
 	if ((dev = pcidtf_get_dev(dtf, params[0])) == NULL) {
 		fprintf(stderr, "ERROR: invalid idx=%d\n", params[0]);
 		exit(1);
 	}
+	if (cmd == CMD_STATS) {
+		show_reg_stats(dev);
+		return;
+	} else if (cmd == CMD_RESET) {
+		if (pcidtf_dev_reset_reg_stats(dev, -1)) {
+			fprintf(stderr,
+				"ERROR: failed to reset register statistics\n");
+			exit(1);
+		}
+		printf("Register statistics reset\n");
+		return;
+	}
 	if ((iomap = pcidtf_dev_get_iomap(dev, params[1])) == NULL) {
 		fprintf(stderr, "ERROR: invalid bar=%d\n", params[1]);
 		exit(1);
@@ -167,14 +259,14 @@ void reg_cmd(PCIDTF * dtf, int argc, char *argv[])
 		printf("Register read - bar=%d, off=%d, len=%d, val=0x%llX\n",
 		       params[1], params[2], params[3], val);
 	} else {
-		if (pcidtf_iomap_write_reg
-		    (iomap, params[2], params[3], params[4])) {
+		if (pcidtf_iomap_write_reg(iomap, params[2], params[3], val)) {
 			fprintf(stderr,
 				"ERROR: failed to write I/O register\n");
 			exit(1);
 		}
-		printf("Register written - bar=%d, off=%d, len=%d, val=0x%X\n",
-		       params[1], params[2], params[3], params[4]);
+		printf
+		    ("Register written - bar=%d, off=%d, len=%d, val=0x%llX\n",
+		     params[1], params[2], params[3], val);
 	}
 }
 
@@ -269,6 +361,105 @@ void dma_cmd(PCIDTF * dtf, int argc, char *argv[])
 	}
 }
 
+/* Run a benchmark at each power-of-two size from 64 B up to max_len */
+void run_bench(PCIDTF_DEV * dev, PCIDTF_BENCH * req, int max_len)
+{
+	PCIDTF_BENCH bench;
+	int len, iters;
+
+	printf("%10s %8s %12s %10s %10s %10s\n", "size", "iters", "MB/s",
+	       "p50 (ns)", "p99 (ns)", "max (ns)");
+	for (len = 64; len > 0 && len <= max_len; len <<= 1) {
+		/* Move about 256 MiB per size within the iteration limit */
+		iters = (256 << 20) / len;
+		if (iters < 4)
+			iters = 4;
+		if (iters > 100000)
+			iters = 100000;
+		bench = *req;
+		bench.len = len;
+		bench.iters = iters;
+		if (pcidtf_dev_run_bench(dev, &bench)) {
+			fprintf(stderr,
+				"ERROR: benchmark failed at size %d\n", len);
+			return;
+		}
+		printf("%10d %8d %12.1f %10llu %10llu %10llu\n", len, iters,
+		       bench.bytes_per_sec / 1e6,
+		       pcidtf_reg_stats_percentile(&bench.lat, 50),
+		       pcidtf_reg_stats_percentile(&bench.lat, 99),
+		       bench.lat.max);
+	}
+}
+
+void bench_cmd(PCIDTF * dtf, int argc, char *argv[])
+{
+	enum {
+		CMD_DMA,
+		CMD_REG,
+		CMD_REG_WRITE
+	} cmd;
+	PCIDTF_DEV *dev;
+	PCIDTF_IOMAP *iomap;
+	PCIDTF_BENCH req;
+	int params[3], max_len;
+
+	if (argc == 4 && strcasecmp(argv[2], "dma") == 0) {
+		cmd = CMD_DMA;
+	} else if ((argc == 5 || argc == 6) &&
+		   strcasecmp(argv[2], "reg") == 0) {
+		cmd = CMD_REG;
+	} else if ((argc == 5 || argc == 6) &&
+		   strcasecmp(argv[2], "regwrite") == 0) {
+		cmd = CMD_REG_WRITE;
+	} else {
+		show_app_info(dtf);
+		fprintf(stderr, "Usage: " APP_NAME " bench dma <idx>\n");
+		fprintf(stderr,
+			"       " APP_NAME " bench reg <idx> <bar> [<width>]\n");
+		fprintf(stderr,
+			"       " APP_NAME
+			" bench regwrite <idx> <bar> [<width>]\n");
+		exit(1);
+	}
+	params[2] = 0;
+	xpcf_get_int_params(argc - 3, argv + 3, params);
+	if ((dev = pcidtf_get_dev(dtf, params[0])) == NULL) {
+		fprintf(stderr, "ERROR: invalid idx=%d\n", params[0]);
+		exit(1);
+	}
+	memset(&req, 0, sizeof(req));
+	if (cmd == CMD_DMA) {
+		printf("Coherent buffer read (memcpy from buffer)\n");
+		req.type = PCIDTF_BENCH_DMA_READ;
+		run_bench(dev, &req, PCIDTF_MAX_BENCH_LEN);
+		printf("\nCoherent buffer write (memcpy to buffer)\n");
+		req.type = PCIDTF_BENCH_DMA_WRITE;
+		run_bench(dev, &req, PCIDTF_MAX_BENCH_LEN);
+	} else {
+		if ((iomap = pcidtf_dev_get_iomap(dev, params[1])) == NULL) {
+			fprintf(stderr, "ERROR: invalid bar=%d\n", params[1]);
+			exit(1);
+		}
+		max_len = pcidtf_iomap_get_len(iomap);
+		if (max_len > PCIDTF_MAX_BENCH_LEN)
+			max_len = PCIDTF_MAX_BENCH_LEN;
+		req.bar = params[1];
+		req.width = params[2];
+		/* Writes overwrite the BAR, so they are only run on request */
+		if (cmd == CMD_REG) {
+			printf("Register read - bar=%d, width=%d\n", req.bar,
+			       req.width);
+			req.type = PCIDTF_BENCH_REG_READ;
+		} else {
+			printf("Register write - bar=%d, width=%d\n", req.bar,
+			       req.width);
+			req.type = PCIDTF_BENCH_REG_WRITE;
+		}
+		run_bench(dev, &req, max_len);
+	}
+}
+
 #ifdef WIN32
 int __cdecl
 #else
@@ -290,12 +481,15 @@ main(int argc, char *argv[])
 		reg_cmd(dtf, argc, argv);
 	} else if (argc >= 2 && strcasecmp(argv[1], "dma") == 0) {
 		dma_cmd(dtf, argc, argv);
+	} else if (argc >= 2 && strcasecmp(argv[1], "bench") == 0) {
+		bench_cmd(dtf, argc, argv);
 	} else {
 		show_app_info(dtf);
 		fprintf(stderr, "Usage: " APP_NAME " dev\n");
 		fprintf(stderr, "       " APP_NAME " cfg\n");
 		fprintf(stderr, "       " APP_NAME " reg\n");
 		fprintf(stderr, "       " APP_NAME " dma\n");
+		fprintf(stderr, "       " APP_NAME " bench\n");
 		exit(1);
 	}
 	pcidtf_cleanup(dtf);